@@ -0,0 +1,30 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Returns whether the command is a builtin text processing stage:
+ *
+ * -> builtin grep [-v] -F PATTERN [$.FIELD]
+ * -> builtin cut [-d DELIM] -f LIST|$.FIELD ...
+ * -> builtin sort [-r] [-n]
+ * -> builtin uniq [-c]
+ * -> builtin count (like sort | uniq -c, but hashed and in first seen order)
+ * -> builtin records [-d DELIM] [-H]
+ *
+ * Lines go between builtin stages as records, split into fields (on DELIM,
+ * a tab by default) at most once. A field is $.N (from 1) or, if records -H
+ * took the names from the first line, $.NAME. cut picks accessed fields in
+ * the order given.
+ */
+bool is_builtin_cmd(char *argv[]);
+
+/*
+ * Runs the given builtin stages as one chain in the current (forked) process,
+ * from stdin to stdout, with lines passed between them in memory. sort spills
+ * to temp files beyond sort_mem bytes. Exits with the last stage's code.
+ */
+void run_builtins(char **argvs[], int nbuiltins, size_t sort_mem);
+
+#endif // BUILTINS_H
@@ -0,0 +1,34 @@
+#ifndef CACHE_H
+#define CACHE_H
+#include <stdbool.h>
+
+#include "context.h"
+#include "exec.h"
+
+/*
+ * Returns whether the pipeline on top of the stack starts with the 'cached'
+ * annotation:
+ *
+ * -> cached [--input=FILE ...] cmd args | ...
+ */
+bool is_cached_pipeline(EnvStack *stack);
+
+/*
+ * Strips the annotation and its options off the first command, returning the
+ * --input files as an allocated, NULL terminated list.
+ */
+char **strip_cached_annotation(EnvStack *stack);
+
+/*
+ * Runs a (stripped) 'cached' pipeline of commands found by popping the stack
+ * the given number of times. The output and exit code are keyed on the argv
+ * of every stage, the environment, the working directory, stdin and the
+ * mtimes of the input files, and served from the on-disk cache
+ * (PLSH_CACHE_DIR, bounded by PLSH_CACHE_MAX bytes) when present. Otherwise
+ * runs pipeline_cmds and stores what it produced if it exited 0. Keyed
+ * stdin is left at its end either way. A terminal stdin is replaced with
+ * /dev/null. Frees the inputs.
+ */
+Result *cached_pipeline_cmds(EnvStack *stack, int ncmds, char *inputs[]);
+
+#endif // CACHE_H
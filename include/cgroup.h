@@ -0,0 +1,37 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct Cgroup {
+    char *path;
+    int dir_fd;
+} Cgroup;
+
+/*
+ * Creates a transient cgroup v2 child of the given (delegated) parent and
+ * applies the given cpu.max and memory.max limits (either may be NULL).
+ * Returns NULL and prints a warning if the cgroup could not be created.
+ */
+Cgroup *create_cgroup(char *parent, char *cpu_max, char *memory_max);
+
+/*
+ * Removes the cgroup (it must be empty) and frees the struct.
+ */
+void destroy_cgroup(Cgroup *cgroup);
+
+/*
+ * Forks with the child placed in the given cgroup, or forks normally if the
+ * cgroup is NULL. If the child does nothing but exec, uses clone3
+ * CLONE_INTO_CGROUP where the kernel supports it, otherwise has the child
+ * move itself before returning.
+ */
+pid_t fork_into_cgroup(Cgroup *cgroup, bool exec_only);
+
+/*
+ * Reads the peak memory (bytes) and total cpu time (microseconds) used in
+ * the cgroup. Values that can't be read are set to -1.
+ */
+void read_cgroup_stats(Cgroup *cgroup, long long *mem_peak, long long *cpu_usec);
+
+#endif // CGROUP_H
@@ -7,6 +7,9 @@ typedef int exit_t;
 
 typedef struct Env {
     char **argv;
+    int split_start;  // Range of argv that came from globs and can be split
+    int split_end;    // across invocations (exclusive), or both -1
+    long deadline_ms; // Time the command gets before it's killed, or -1
     char **names;
     char **values;
     int nvals;
@@ -44,7 +47,7 @@ Env * get_env(EnvStack *stack);
 char * get_stack_var(EnvStack *stack, char *name);
 
 /*
- * Adds a variable to the stack.
+ * Adds a variable to the stack, copying the value.
  */
 void add_stack_var(EnvStack *stack, char *name, char *value);
 
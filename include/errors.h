@@ -31,6 +31,12 @@ void die_invalid_syntax(char *msg, int linenum);
  */
 void die_errno(char *msg);
 
+/*
+ * Exits a forked child with a appropriate errno message, without flushing
+ * (or rewinding) the stdio streams it shares with the parent.
+ */
+void die_child_errno(char *msg);
+
 /*
  * Exits the program with a message about no memory.
  */
@@ -7,6 +7,8 @@ typedef struct Result {
     char *output;
     exit_t code;
     int out_fd;
+    long long mem_peak;  // Bytes, or -1 if not measured
+    long long cpu_usec;  // Microseconds, or -1 if not measured
 } Result;
 
 /*
@@ -40,10 +42,28 @@ void destroy_result(Result *result);
 
 /*
  * Runs a pipeline of commands found by popping the stack the given number of
- * times.
+ * times. If PLSH_CGROUP names a delegated cgroup v2 directory, the pipeline
+ * runs in a transient child of it (limited by PLSH_CPU_MAX and
+ * PLSH_MEMORY_MAX) and its resource usage is put in the result. If
+ * PLSH_ARG_SPLIT is set, a command whose glob matches don't fit in one exec is
+ * split into as many invocations as the kernel's argument limit takes, with
+ * PLSH_ARG_SPLIT of them running at once and their output kept in order. Only
+ * matches of adjacent globs are split, $var isn't word split so can't be.
+ * Stages run past their deadline (or the pipeline past PLSH_DEADLINE) are sent
+ * SIGTERM and then SIGKILL, the result's code then being 124 whichever stage it
+ * was. Consecutive builtin stages run together in one process (see
+ * builtins.h), their sort buffering up to PLSH_SORT_MEM bytes. A leading echo
+ * (without options) isn't run, the next stage reads its words from echo_to_fd
+ * instead.
  */
 Result *pipeline_cmds(EnvStack *stack, int ncmds);
 
+/*
+ * Returns a sealed memfd (or a temp file), at its start, holding what echo
+ * would print for the given arguments.
+ */
+int echo_to_fd(char *args[]);
+
 /*
  * Reads the given file into a string.
  */
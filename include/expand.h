@@ -0,0 +1,45 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct DirListing {
+    char *path;
+    char *names;           // Every entry name, null terminated, back to back
+    size_t names_size;
+    size_t *offsets;       // Offset of each entry name into names
+    unsigned char *types;  // d_type of each entry
+    size_t nentries;
+} DirListing;
+
+typedef struct DirCache {
+    DirListing **buckets;  // Open addressed by path hash
+    size_t nbuckets;
+    size_t nlistings;
+} DirCache;
+
+/*
+ * Creates a cache of directory listings, so a directory is only read once
+ * no matter how many globs in a statement look at it.
+ */
+DirCache *dir_cache_create();
+
+/*
+ * Destroys a DirCache struct and the listings in it.
+ */
+void destroy_dir_cache(DirCache *cache);
+
+/*
+ * Returns whether the given argument has any unescaped glob characters
+ * ('*', '?' or '[').
+ */
+bool has_glob_chars(char *arg);
+
+/*
+ * Expands the glob pattern ('*', '?', '[...]' and '**' for any number of
+ * directories) into a sorted, allocated, NULL terminated list of paths and
+ * puts the number of them into nmatches. Returns NULL if nothing matched.
+ */
+char **expand_glob(char *pattern, DirCache *cache, size_t *nmatches);
+
+#endif // EXPAND_H
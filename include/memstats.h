@@ -0,0 +1,54 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+#include <stddef.h>
+
+typedef enum MemSubsystem {
+    MEM_OTHER,
+    MEM_LEXER,
+    MEM_STR_BUILDER,
+    MEM_ENV_STACK,
+    MEM_ARGV,
+    MEM_RESULT,
+    NMEM_SUBSYSTEMS
+} MemSubsystem;
+
+/*
+ * Turns on counting of the allocations made through must_malloc and friends,
+ * by script line and subsystem, and dumps the counts to stderr at exit.
+ */
+void enable_mem_stats();
+
+/*
+ * Sets the script line that allocations are counted against.
+ */
+void set_mem_stats_line(int linenum);
+
+/*
+ * Counts allocations against the given subsystem until mem_stats_leave is
+ * given the returned value. The outermost subsystem wins, so a StrBuilder used
+ * by the lexer counts as the lexer's.
+ */
+MemSubsystem mem_stats_enter(MemSubsystem subsystem);
+
+/*
+ * Goes back to counting against the subsystem from before mem_stats_enter.
+ */
+void mem_stats_leave(MemSubsystem previous);
+
+/*
+ * Counts the allocation.
+ */
+void mem_stats_alloc(void *ptr);
+
+/*
+ * Counts old_ptr being realloced to ptr. It isn't another allocation, only
+ * growth is added to the bytes allocated, against where old_ptr was made.
+ */
+void mem_stats_realloc(void *old_ptr, void *ptr);
+
+/*
+ * Counts the allocation as freed, if it was counted.
+ */
+void mem_stats_free(void *ptr);
+
+#endif // MEMSTATS_H
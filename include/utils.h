@@ -1,5 +1,6 @@
 #ifndef UTILS_H
 #define UTILS_H
+#include <stdbool.h>
 #include <stddef.h>
 
 typedef struct StrBuilder {
@@ -8,6 +9,17 @@ typedef struct StrBuilder {
     size_t size;
 } StrBuilder;
 
+typedef struct LineReader {
+    int fd;
+    char delim;
+    char *buf;
+    size_t bufsize;
+    size_t start;  // Start of the next record in buf
+    size_t end;    // End of the valid data in buf
+    bool mapped;
+    bool eof;
+} LineReader;
+
 /*
  * Creates a StrBuilder struct that can be used to build a string.
  */
@@ -38,6 +50,31 @@ void str_build_add_substr(StrBuilder *build, char *str, int start, int end);
  */
 char *str_build_to_str(StrBuilder *build);
 
+/*
+ * Creates a LineReader that splits the given file descriptor into records
+ * ending with delim. Regular files are mmaped, everything else is read in
+ * large chunks.
+ */
+LineReader *line_reader_create(int fd, char delim);
+
+/*
+ * Destroys a LineReader struct (does not close the file descriptor).
+ */
+void destroy_line_reader(LineReader *reader);
+
+/*
+ * Returns the next record (without the delimiter) and puts its length into
+ * len, or NULL on EOF. The record is a view into the reader's buffer, so it
+ * is not null terminated and is only valid until the next call.
+ */
+char *line_reader_next(LineReader *reader, size_t *len);
+
+/*
+ * Parses a duration ("10", "10s", "250ms", "5m" or "1h", seconds by default)
+ * into milliseconds. Returns -1 if NULL, invalid or too long to represent.
+ */
+long parse_duration_ms(char *duration);
+
 /*
  * Mallocs and dies if ENOMEM.
  */
@@ -53,6 +90,11 @@ void *must_realloc(void *ptr, size_t size);
  */
 char *must_strdup(char *string);
 
+/*
+ * Frees memory from must_malloc and friends, so --mem-stats sees it go.
+ */
+void must_free(void *ptr);
+
 /*
  * Copies argv and it's contents.
  */
@@ -0,0 +1,48 @@
+#ifndef WATCH_H
+#define WATCH_H
+#include <stdbool.h>
+
+/*
+ * Turns on watch mode for the given script. What each top level statement
+ * reads and writes is recorded as it runs, so it can be re-run when that
+ * changes. The plsh arguments are kept to restart with if the script itself
+ * changes.
+ */
+void watch_init(char *plsh_argv[], char *script);
+
+/*
+ * Returns whether watch mode is on.
+ */
+bool is_watching();
+
+/*
+ * Starts recording for the statement at the given offset of the script.
+ */
+void watch_begin_statement(long offset, int linenum);
+
+/*
+ * Records that the current statement read (or wrote) the given variable.
+ */
+void watch_note_var(char *name, bool written);
+
+/*
+ * Records that the current statement referenced the given path, if it
+ * exists.
+ */
+void watch_note_path(char *path);
+
+/*
+ * Waits (with inotify) until a path some statement referenced changes and
+ * marks those statements stale. Changes the statements made themselves as
+ * they ran are ignored. Restarts plsh if the script changes.
+ */
+void watch_wait();
+
+/*
+ * Gets the next statement to re-run, being stale or reading a variable that
+ * an earlier re-run statement wrote, and starts recording for it. Returns
+ * false once there are none left.
+ */
+bool watch_next_stale(long *offset, int *linenum);
+
+#endif // WATCH_H
@@ -0,0 +1,901 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "errors.h"
+#include "utils.h"
+
+#define BUILTIN_ANNOTATION "builtin"
+#define OUT_BUF_SIZE (1 << 16)
+#define ARENA_BUF_SIZE (1 << 16)
+#define NUMBER_BUF_SIZE 64
+#define COUNT_TABLE_SIZE 1024
+#define SORT_MAX_THREADS 8
+#define SORT_MIN_LINES_PER_THREAD (1 << 15)
+
+typedef enum BuiltinKind {
+    GREP,
+    CUT,
+    SORT,
+    UNIQ,
+    COUNT,
+    RECORDS
+} BuiltinKind;
+
+/*
+ * A line in flight between stages. Its fields are split at most once per
+ * delimiter: starts holds each field's offset in the line plus, last, one
+ * past the line's end, and stays NULL until a stage needs the fields.
+ */
+typedef struct Record {
+    char *line;
+    size_t len;
+    char delim;
+    size_t *starts;
+    size_t nfields;
+} Record;
+
+// A $.1 or $.name accessor, names are resolved to an index by the header
+typedef struct Field {
+    size_t index;  // 1 based, or 0 until resolved
+    char *name;
+} Field;
+
+// What sort compares first, worked out once per line rather than on every
+// comparison: the number for sort -n, otherwise the first bytes (big endian),
+// which settle most comparisons without going to the line itself
+typedef union SortKey {
+    double number;
+    uint64_t prefix;
+} SortKey;
+
+// Lines live in an arena that moves when it grows, so they're kept by offset
+typedef struct Line {
+    size_t offset;
+    size_t len;
+    SortKey key;
+} Line;
+
+typedef struct CountEntry {
+    Line line;
+    uint64_t hash;
+    size_t count;
+} CountEntry;
+
+typedef struct Arena {
+    char *buf;
+    size_t bufsize;
+    size_t size;
+} Arena;
+
+typedef struct Output {
+    char buf[OUT_BUF_SIZE];
+    size_t size;
+} Output;
+
+typedef struct Builtin {
+    BuiltinKind kind;
+    struct Builtin *next;  // Where lines go, or NULL for the output
+    Output *out;
+    int code;
+
+    // Records, for any stage that splits lines into fields
+    char delim;
+    bool has_delim;
+    Field *accessors;
+    size_t naccessors;
+    size_t *fields;
+    size_t fields_bufsize;
+    size_t *out_fields;
+    size_t out_fields_bufsize;
+    bool has_header;
+    bool seen_header;
+
+    // grep
+    char *pattern;
+    size_t pattern_len;
+    bool invert;
+    size_t nmatched;
+
+    // cut
+    size_t *ranges;  // Inclusive (first, last) field pairs, 1 based
+    size_t nranges;
+    Arena scratch;
+
+    // sort
+    bool reverse;
+    bool numeric;
+    size_t sort_mem;
+    Arena arena;
+    Line *lines;
+    size_t nlines;
+    size_t lines_bufsize;
+    FILE **runs;
+    size_t nruns;
+
+    // uniq and count
+    bool show_count;
+    Line prev;
+    size_t prev_count;
+    bool has_prev;
+    CountEntry *entries;
+    size_t nentries;
+    size_t entries_bufsize;
+    size_t *table;  // Entry index plus one, zero when empty
+    size_t table_size;
+} Builtin;
+
+typedef struct SortTask {
+    Line *lines;
+    size_t nlines;
+} SortTask;
+
+typedef struct MergeRun {
+    LineReader *reader;
+    char *line;
+    size_t len;
+    SortKey key;
+} MergeRun;
+
+static void push_record(Builtin *builtin, Record *record);
+static void push_header(Builtin *builtin, Record *names);
+static void finish_builtin(Builtin *builtin);
+
+// qsort has no context argument, every sort in the chain shares these
+static char *sort_base;
+static bool sort_reverse;
+static bool sort_numeric;
+
+bool is_builtin_cmd(char *argv[]) {
+    return strcmp(argv[0], BUILTIN_ANNOTATION) == 0;
+}
+
+static void die_usage(char *usage) {
+    fprintf(stderr, "Usage: %s %s\n", BUILTIN_ANNOTATION, usage);
+    _exit(2);
+}
+
+static size_t arena_add(Arena *arena, char *str, size_t len) {
+    if (arena->size + len + 1 > arena->bufsize) {
+        arena->bufsize = (arena->size + len + 1) * 2;
+        if (arena->bufsize < ARENA_BUF_SIZE) arena->bufsize = ARENA_BUF_SIZE;
+        arena->buf = must_realloc(arena->buf, arena->bufsize);
+    }
+    size_t offset = arena->size;
+    memcpy(arena->buf + offset, str, len);
+    arena->buf[offset + len] = '\0';
+    arena->size += len + 1;
+    return offset;
+}
+
+static void flush_output(Output *out) {
+    for (size_t written = 0; written < out->size;) {
+        ssize_t n = write(STDOUT_FILENO, out->buf + written, out->size - written);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) die_child_errno("Failed to write");
+        written += n;
+    }
+    out->size = 0;
+}
+
+static void write_output(Output *out, char *str, size_t len) {
+    while (len > 0) {
+        if (out->size == OUT_BUF_SIZE) flush_output(out);
+        size_t n = OUT_BUF_SIZE - out->size;
+        if (n > len) n = len;
+        memcpy(out->buf + out->size, str, n);
+        out->size += n;
+        str += n;
+        len -= n;
+    }
+}
+
+static void emit_record(Builtin *builtin, Record *record) {
+    if (builtin->next) {
+        push_record(builtin->next, record);
+        return;
+    }
+    // Records only become text again where they leave the chain
+    write_output(builtin->out, record->line, record->len);
+    write_output(builtin->out, "\n", 1);
+}
+
+static void emit_line(Builtin *builtin, char *line, size_t len) {
+    Record record = { .line = line, .len = len, .starts = NULL };
+    emit_record(builtin, &record);
+}
+
+static void emit_header(Builtin *builtin, Record *names) {
+    if (builtin->next) push_header(builtin->next, names);
+    else emit_record(builtin, names);
+}
+
+static size_t *grow_fields(size_t *fields, size_t *bufsize, size_t size) {
+    if (size <= *bufsize) return fields;
+    *bufsize = size * 2;
+    return must_realloc(fields, sizeof *fields * *bufsize);
+}
+
+static char get_delim(Builtin *builtin, Record *record) {
+    if (builtin->has_delim) return builtin->delim;
+    return record->starts ? record->delim : '\t';
+}
+
+/*
+ * Splits the record into fields on the given delimiter, unless an earlier
+ * stage already has.
+ */
+static void split_record(Builtin *builtin, Record *record, char delim) {
+    if (record->starts && record->delim == delim) return;
+
+    size_t nfields = 0;
+    char *end = record->line + record->len;
+    for (char *field = record->line;;) {
+        builtin->fields = grow_fields(builtin->fields, &builtin->fields_bufsize, nfields + 2);
+        builtin->fields[nfields++] = field - record->line;
+        field = memchr(field, delim, end - field);
+        if (!field) break;
+        field++;
+    }
+    builtin->fields[nfields] = record->len + 1;  // As if there was a delimiter
+    record->starts = builtin->fields;
+    record->nfields = nfields;
+    record->delim = delim;
+}
+
+static char *get_field(Record *record, size_t index, size_t *len) {
+    if (index > record->nfields) {
+        *len = 0;
+        return record->line + record->len;
+    }
+    *len = record->starts[index] - record->starts[index - 1] - 1;
+    return record->line + record->starts[index - 1];
+}
+
+static size_t get_accessor_index(Field *accessor) {
+    if (accessor->index == 0) {
+        fprintf(stderr, "%s: No header to find field $.%s in\n", BUILTIN_ANNOTATION,
+                accessor->name);
+        _exit(2);
+    }
+    return accessor->index;
+}
+
+static void resolve_accessors(Builtin *builtin, Record *names) {
+    for (size_t i = 0; i < builtin->naccessors; i++) {
+        Field *accessor = &builtin->accessors[i];
+        if (!accessor->name) continue;
+
+        size_t name_len = strlen(accessor->name);
+        for (size_t j = 1; j <= names->nfields && accessor->index == 0; j++) {
+            size_t len;
+            char *name = get_field(names, j, &len);
+            if (len == name_len && memcmp(name, accessor->name, len) == 0) accessor->index = j;
+        }
+        if (accessor->index == 0) {
+            fprintf(stderr, "%s: No field $.%s in header\n", BUILTIN_ANNOTATION, accessor->name);
+            _exit(2);
+        }
+    }
+}
+
+static void emit_counted_line(Builtin *builtin, size_t count, char *line, size_t len) {
+    // Same format as uniq -c
+    char prefix[32];
+    int prefix_len = snprintf(prefix, sizeof prefix, "%7zu ", count);
+    Arena *scratch = &builtin->scratch;
+    scratch->size = 0;
+    arena_add(scratch, prefix, prefix_len);
+    scratch->size--;  // Drop the null, the line goes on after
+    arena_add(scratch, line, len);
+    emit_line(builtin, scratch->buf, prefix_len + len);
+}
+
+/*
+ * Adds the accessor if the argument is one ($.1 or $.name).
+ */
+static bool parse_accessor(Builtin *builtin, char *arg) {
+    if (strncmp(arg, "$.", 2) != 0 || arg[2] == '\0') return false;
+
+    Field accessor = { .index = 0, .name = NULL };
+    char *end;
+    unsigned long index = strtoul(arg + 2, &end, 10);
+    if (*end == '\0' && index > 0) accessor.index = index;
+    else accessor.name = arg + 2;
+
+    builtin->accessors = must_realloc(builtin->accessors,
+                                      sizeof *builtin->accessors * (builtin->naccessors + 1));
+    builtin->accessors[builtin->naccessors++] = accessor;
+    return true;
+}
+
+static void parse_grep(Builtin *builtin, char *argv[]) {
+    char *usage = "grep [-v] -F PATTERN [$.FIELD]";
+    bool fixed = false;
+    int i = 2;
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        for (char *opt = argv[i] + 1; *opt != '\0'; opt++) {
+            if (*opt == 'F') fixed = true;
+            else if (*opt == 'v') builtin->invert = true;
+            else die_usage(usage);
+        }
+    }
+    // Only fixed strings are supported, so make the caller say so
+    if (!fixed || argv[i] == NULL) die_usage(usage);
+    if (argv[i + 1] != NULL && (!parse_accessor(builtin, argv[i + 1]) || argv[i + 2] != NULL))
+        die_usage(usage);
+    builtin->pattern = argv[i];
+    builtin->pattern_len = strlen(argv[i]);
+}
+
+static void parse_cut_fields(Builtin *builtin, char *list) {
+    char *usage = "cut [-d DELIM] -f LIST|$.FIELD ...";
+    char *end;
+    for (char *range = list; *range != '\0';) {
+        size_t first = 1;
+        size_t last = SIZE_MAX;
+        if (*range != '-') {
+            first = strtoul(range, &end, 10);
+            if (end == range || first == 0) die_usage(usage);
+            range = end;
+            last = first;
+        }
+        if (*range == '-') {
+            range++;
+            last = SIZE_MAX;
+            if (*range != ',' && *range != '\0') {
+                last = strtoul(range, &end, 10);
+                if (end == range || last < first) die_usage(usage);
+                range = end;
+            }
+        }
+        if (*range == ',') range++;
+        else if (*range != '\0') die_usage(usage);
+
+        builtin->ranges = must_realloc(builtin->ranges,
+                                       sizeof *builtin->ranges * 2 * (builtin->nranges + 1));
+        builtin->ranges[2 * builtin->nranges] = first;
+        builtin->ranges[2 * builtin->nranges + 1] = last;
+        builtin->nranges++;
+    }
+    if (builtin->nranges == 0) die_usage(usage);
+}
+
+static void parse_cut(Builtin *builtin, char *argv[]) {
+    char *usage = "cut [-d DELIM] -f LIST|$.FIELD ...";
+    char *fields = NULL;
+    for (int i = 2; argv[i] != NULL; i++) {
+        if (parse_accessor(builtin, argv[i])) continue;
+        if (argv[i][0] != '-' || (argv[i][1] != 'd' && argv[i][1] != 'f')) die_usage(usage);
+        char opt = argv[i][1];
+        char *value = argv[i][2] != '\0' ? argv[i] + 2 : argv[++i];
+        if (value == NULL) die_usage(usage);
+
+        if (opt == 'd') {
+            if (strlen(value) != 1) die_usage(usage);
+            builtin->delim = value[0];
+            builtin->has_delim = true;
+        }
+        else fields = value;
+    }
+    // Either a list of fields or accessors, which pick fields in their order
+    if (!fields == (builtin->naccessors == 0)) die_usage(usage);
+    if (fields) parse_cut_fields(builtin, fields);
+}
+
+static void parse_records(Builtin *builtin, char *argv[]) {
+    char *usage = "records [-d DELIM] [-H]";
+    builtin->delim = '\t';
+    builtin->has_delim = true;
+    for (int i = 2; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-H") == 0) {
+            builtin->has_header = true;
+            continue;
+        }
+        if (strncmp(argv[i], "-d", 2) != 0) die_usage(usage);
+        char *value = argv[i][2] != '\0' ? argv[i] + 2 : argv[++i];
+        if (value == NULL || strlen(value) != 1) die_usage(usage);
+        builtin->delim = value[0];
+    }
+}
+
+static void parse_flags(Builtin *builtin, char *argv[], char *flags, char *usage) {
+    for (int i = 2; argv[i] != NULL; i++) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0') die_usage(usage);
+        for (char *opt = argv[i] + 1; *opt != '\0'; opt++) {
+            if (!strchr(flags, *opt)) die_usage(usage);
+            if (*opt == 'r') builtin->reverse = true;
+            if (*opt == 'n') builtin->numeric = true;
+            if (*opt == 'c') builtin->show_count = true;
+        }
+    }
+}
+
+static void parse_builtin(Builtin *builtin, char *argv[]) {
+    char *name = argv[1];
+    if (!name) die_usage("grep|cut|sort|uniq|count|records ...");
+
+    if (strcmp(name, "grep") == 0) {
+        builtin->kind = GREP;
+        parse_grep(builtin, argv);
+    }
+    else if (strcmp(name, "cut") == 0) {
+        builtin->kind = CUT;
+        parse_cut(builtin, argv);
+    }
+    else if (strcmp(name, "sort") == 0) {
+        builtin->kind = SORT;
+        parse_flags(builtin, argv, "rn", "sort [-r] [-n]");
+    }
+    else if (strcmp(name, "uniq") == 0) {
+        builtin->kind = UNIQ;
+        parse_flags(builtin, argv, "c", "uniq [-c]");
+    }
+    else if (strcmp(name, "count") == 0) {
+        builtin->kind = COUNT;
+        parse_flags(builtin, argv, "", "count");
+    }
+    else if (strcmp(name, "records") == 0) {
+        builtin->kind = RECORDS;
+        parse_records(builtin, argv);
+    }
+    else die_usage("grep|cut|sort|uniq|count|records ...");
+}
+
+static void push_grep(Builtin *builtin, Record *record) {
+    char *str = record->line;
+    size_t len = record->len;
+    if (builtin->naccessors > 0) {
+        split_record(builtin, record, get_delim(builtin, record));
+        str = get_field(record, get_accessor_index(&builtin->accessors[0]), &len);
+    }
+
+    // glibc's memmem is vectorized, which is as good as we'd do by hand
+    bool found = builtin->pattern_len == 0
+        || memmem(str, len, builtin->pattern, builtin->pattern_len) != NULL;
+    if (found == builtin->invert) return;
+    builtin->nmatched++;
+    emit_record(builtin, record);  // Still split, so later stages needn't
+}
+
+static bool is_cut_field(Builtin *builtin, size_t field) {
+    for (size_t i = 0; i < builtin->nranges; i++)
+        if (field >= builtin->ranges[2 * i] && field <= builtin->ranges[2 * i + 1]) return true;
+    return false;
+}
+
+static void add_cut_field(Builtin *builtin, Record *out, char *field, size_t len) {
+    Arena *scratch = &builtin->scratch;
+    if (out->nfields > 0) scratch->buf[scratch->size - 1] = out->delim;
+    builtin->out_fields = grow_fields(builtin->out_fields, &builtin->out_fields_bufsize,
+                                      out->nfields + 2);
+    builtin->out_fields[out->nfields++] = arena_add(scratch, field, len);
+}
+
+/*
+ * Projects the record's fields into out, which comes already split. Returns
+ * false if there's nothing to project.
+ */
+static bool cut_record(Builtin *builtin, Record *record, Record *out) {
+    for (size_t i = 0; i < builtin->naccessors; i++) get_accessor_index(&builtin->accessors[i]);
+    char delim = get_delim(builtin, record);
+    split_record(builtin, record, delim);
+    // Like cut, lines without a delimiter pass through whole
+    if (record->nfields == 1) return false;
+
+    builtin->scratch.size = 0;
+    *out = (Record) { .delim = delim, .nfields = 0 };
+    size_t len;
+    char *field;
+    if (builtin->naccessors > 0) {
+        for (size_t i = 0; i < builtin->naccessors; i++) {
+            field = get_field(record, get_accessor_index(&builtin->accessors[i]), &len);
+            add_cut_field(builtin, out, field, len);
+        }
+    }
+    else {
+        for (size_t i = 1; i <= record->nfields; i++) {
+            if (!is_cut_field(builtin, i)) continue;
+            field = get_field(record, i, &len);
+            add_cut_field(builtin, out, field, len);
+        }
+    }
+
+    // Selecting none of the fields leaves an empty line, as cut does
+    builtin->out_fields = grow_fields(builtin->out_fields, &builtin->out_fields_bufsize,
+                                      out->nfields + 1);
+    out->line = out->nfields > 0 ? builtin->scratch.buf : "";
+    out->len = out->nfields > 0 ? builtin->scratch.size - 1 : 0;
+    out->starts = builtin->out_fields;
+    out->starts[out->nfields] = out->len + 1;
+    return true;
+}
+
+static void push_cut(Builtin *builtin, Record *record) {
+    Record out;
+    emit_record(builtin, cut_record(builtin, record, &out) ? &out : record);
+}
+
+static void push_records(Builtin *builtin, Record *record) {
+    split_record(builtin, record, builtin->delim);
+    if (builtin->has_header && !builtin->seen_header) {
+        builtin->seen_header = true;
+        emit_header(builtin, record);
+    }
+    else emit_record(builtin, record);
+}
+
+static double parse_number(char *line, size_t len) {
+    char buf[NUMBER_BUF_SIZE];
+    if (len >= sizeof buf) len = sizeof buf - 1;
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    return strtod(buf, NULL);  // Like sort -n, anything else is 0
+}
+
+static SortKey get_sort_key(char *line, size_t len, bool numeric) {
+    SortKey key = { .prefix = 0 };
+    if (!line) return key;
+    if (numeric) key.number = parse_number(line, len);
+    else {
+        // Zero padded, so a shorter line still comes first
+        for (size_t i = 0; i < sizeof key.prefix; i++)
+            key.prefix = key.prefix << 8 | (i < len ? (unsigned char) line[i] : 0);
+    }
+    return key;
+}
+
+static int compare_strs(char *a, size_t alen, SortKey akey, char *b, size_t blen, SortKey bkey) {
+    int cmp = 0;
+    if (sort_numeric && akey.number != bkey.number) cmp = akey.number < bkey.number ? -1 : 1;
+    else if (!sort_numeric && akey.prefix != bkey.prefix) cmp = akey.prefix < bkey.prefix ? -1 : 1;
+
+    // Byte order, as sort does with LC_ALL=C
+    if (cmp == 0) cmp = memcmp(a, b, alen < blen ? alen : blen);
+    if (cmp == 0 && alen != blen) cmp = alen < blen ? -1 : 1;
+    return sort_reverse ? -cmp : cmp;
+}
+
+static int compare_lines(const void *a, const void *b) {
+    const Line *left = a;
+    const Line *right = b;
+    return compare_strs(sort_base + left->offset, left->len, left->key,
+                        sort_base + right->offset, right->len, right->key);
+}
+
+static void *sort_task(void *arg) {
+    SortTask *task = arg;
+    qsort(task->lines, task->nlines, sizeof *task->lines, compare_lines);
+    return NULL;
+}
+
+/*
+ * Sorts the buffered lines, splitting big buffers between threads and then
+ * merging the sorted parts.
+ */
+static void sort_buffered_lines(Builtin *builtin) {
+    sort_base = builtin->arena.buf;
+    sort_reverse = builtin->reverse;
+    sort_numeric = builtin->numeric;
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = builtin->nlines / SORT_MIN_LINES_PER_THREAD;
+    if (nthreads > (size_t) ncpus) nthreads = ncpus;
+    if (nthreads > SORT_MAX_THREADS) nthreads = SORT_MAX_THREADS;
+    if (nthreads < 2) {
+        qsort(builtin->lines, builtin->nlines, sizeof *builtin->lines, compare_lines);
+        return;
+    }
+
+    pthread_t threads[SORT_MAX_THREADS];
+    SortTask tasks[SORT_MAX_THREADS];
+    bool threaded[SORT_MAX_THREADS];
+    size_t bounds[SORT_MAX_THREADS + 1];
+    size_t per_thread = builtin->nlines / nthreads;
+    for (size_t i = 0; i < nthreads; i++) {
+        bounds[i] = i * per_thread;
+        tasks[i].lines = builtin->lines + bounds[i];
+        tasks[i].nlines = (i == nthreads - 1 ? builtin->nlines : bounds[i] + per_thread)
+                          - bounds[i];
+        threaded[i] = pthread_create(&threads[i], NULL, sort_task, &tasks[i]) == 0;
+        if (!threaded[i]) sort_task(&tasks[i]);
+    }
+    bounds[nthreads] = builtin->nlines;
+    for (size_t i = 0; i < nthreads; i++)
+        if (threaded[i]) pthread_join(threads[i], NULL);
+
+    // Merge neighbouring parts until there's one
+    Line *tmp = must_malloc(sizeof *tmp * builtin->nlines);
+    Line *src = builtin->lines;
+    for (size_t width = 1; width < nthreads; width *= 2) {
+        for (size_t i = 0; i < nthreads; i += 2 * width) {
+            size_t lo = bounds[i];
+            size_t mid = bounds[i + width < nthreads ? i + width : nthreads];
+            size_t hi = bounds[i + 2 * width < nthreads ? i + 2 * width : nthreads];
+            size_t l = lo, r = mid, out = lo;
+            while (l < mid && r < hi)
+                tmp[out++] = compare_lines(&src[r], &src[l]) < 0 ? src[r++] : src[l++];
+            while (l < mid) tmp[out++] = src[l++];
+            while (r < hi) tmp[out++] = src[r++];
+        }
+        Line *swap = src;
+        src = tmp;
+        tmp = swap;
+    }
+    if (src != builtin->lines) {
+        memcpy(builtin->lines, src, sizeof *src * builtin->nlines);
+        tmp = src;
+    }
+    must_free(tmp);
+}
+
+/*
+ * Writes the buffered lines, sorted, into a new temp file run.
+ */
+static void spill_sort_run(Builtin *builtin) {
+    sort_buffered_lines(builtin);
+    FILE *run = tmpfile();
+    if (!run) die_child_errno("Failed to spill sort");
+    for (size_t i = 0; i < builtin->nlines; i++) {
+        Line *line = &builtin->lines[i];
+        fwrite(builtin->arena.buf + line->offset, 1, line->len, run);
+        putc('\n', run);
+    }
+    if (fflush(run) == EOF) die_child_errno("Failed to spill sort");
+
+    builtin->runs = must_realloc(builtin->runs, sizeof *builtin->runs * (builtin->nruns + 1));
+    builtin->runs[builtin->nruns++] = run;
+    builtin->arena.size = 0;
+    builtin->nlines = 0;
+}
+
+static void push_sort(Builtin *builtin, char *line, size_t len) {
+    size_t used = builtin->arena.size + sizeof *builtin->lines * builtin->nlines;
+    if (builtin->nlines > 0 && used + len + 1 + sizeof *builtin->lines > builtin->sort_mem)
+        spill_sort_run(builtin);
+
+    if (builtin->nlines == builtin->lines_bufsize) {
+        builtin->lines_bufsize = builtin->lines_bufsize ? builtin->lines_bufsize * 2 : 1024;
+        builtin->lines = must_realloc(builtin->lines,
+                                      sizeof *builtin->lines * builtin->lines_bufsize);
+    }
+    Line *buffered = &builtin->lines[builtin->nlines++];
+    buffered->offset = arena_add(&builtin->arena, line, len);
+    buffered->len = len;
+    buffered->key = get_sort_key(line, len, builtin->numeric);
+}
+
+static bool merge_run_before(MergeRun *a, MergeRun *b) {
+    return compare_strs(a->line, a->len, a->key, b->line, b->len, b->key) < 0;
+}
+
+static void sift_merge_heap(MergeRun *heap, size_t nheap, size_t i) {
+    for (;;) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1, right = 2 * i + 2;
+        if (left < nheap && merge_run_before(&heap[left], &heap[smallest])) smallest = left;
+        if (right < nheap && merge_run_before(&heap[right], &heap[smallest])) smallest = right;
+        if (smallest == i) return;
+
+        MergeRun swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+static void finish_sort(Builtin *builtin) {
+    if (builtin->nruns == 0) {
+        sort_buffered_lines(builtin);
+        for (size_t i = 0; i < builtin->nlines; i++) {
+            Line *line = &builtin->lines[i];
+            emit_line(builtin, builtin->arena.buf + line->offset, line->len);
+        }
+        return;
+    }
+    if (builtin->nlines > 0) spill_sort_run(builtin);
+    sort_reverse = builtin->reverse;
+    sort_numeric = builtin->numeric;
+
+    // k-way merge of the runs, which come back mmaped through LineReaders
+    MergeRun *heap = must_malloc(sizeof *heap * builtin->nruns);
+    size_t nheap = 0;
+    for (size_t i = 0; i < builtin->nruns; i++) {
+        int fd = fileno(builtin->runs[i]);
+        lseek(fd, 0, SEEK_SET);
+        heap[nheap].reader = line_reader_create(fd, '\n');
+        heap[nheap].line = line_reader_next(heap[nheap].reader, &heap[nheap].len);
+        heap[nheap].key = get_sort_key(heap[nheap].line, heap[nheap].len, builtin->numeric);
+        if (heap[nheap].line) nheap++;
+        else destroy_line_reader(heap[nheap].reader);
+    }
+    for (size_t i = nheap; i-- > 0;) sift_merge_heap(heap, nheap, i);
+
+    while (nheap > 0) {
+        emit_line(builtin, heap[0].line, heap[0].len);
+        heap[0].line = line_reader_next(heap[0].reader, &heap[0].len);
+        heap[0].key = get_sort_key(heap[0].line, heap[0].len, builtin->numeric);
+        if (!heap[0].line) {
+            destroy_line_reader(heap[0].reader);
+            heap[0] = heap[--nheap];
+        }
+        sift_merge_heap(heap, nheap, 0);
+    }
+    must_free(heap);
+    for (size_t i = 0; i < builtin->nruns; i++) fclose(builtin->runs[i]);
+}
+
+static void push_uniq(Builtin *builtin, char *line, size_t len) {
+    Arena *arena = &builtin->arena;
+    if (builtin->has_prev && builtin->prev.len == len
+        && memcmp(arena->buf + builtin->prev.offset, line, len) == 0) {
+        builtin->prev_count++;
+        return;
+    }
+
+    if (builtin->has_prev) {
+        char *prev = arena->buf + builtin->prev.offset;
+        if (builtin->show_count)
+            emit_counted_line(builtin, builtin->prev_count, prev, builtin->prev.len);
+        else emit_line(builtin, prev, builtin->prev.len);
+    }
+    arena->size = 0;
+    builtin->prev.offset = arena_add(arena, line, len);
+    builtin->prev.len = len;
+    builtin->prev_count = 1;
+    builtin->has_prev = true;
+}
+
+static void finish_uniq(Builtin *builtin) {
+    if (!builtin->has_prev) return;
+    char *prev = builtin->arena.buf + builtin->prev.offset;
+    if (builtin->show_count)
+        emit_counted_line(builtin, builtin->prev_count, prev, builtin->prev.len);
+    else emit_line(builtin, prev, builtin->prev.len);
+}
+
+static uint64_t hash_line(char *line, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+    for (size_t i = 0; i < len; i++) hash = (hash ^ (unsigned char) line[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static void grow_count_table(Builtin *builtin) {
+    free(builtin->table);
+    builtin->table_size = builtin->table_size ? builtin->table_size * 2 : COUNT_TABLE_SIZE;
+    builtin->table = calloc(builtin->table_size, sizeof *builtin->table);
+    if (!builtin->table) die_no_mem();
+
+    size_t mask = builtin->table_size - 1;
+    for (size_t i = 0; i < builtin->nentries; i++) {
+        size_t slot = builtin->entries[i].hash & mask;
+        while (builtin->table[slot]) slot = (slot + 1) & mask;
+        builtin->table[slot] = i + 1;
+    }
+}
+
+static void push_count(Builtin *builtin, char *line, size_t len) {
+    if ((builtin->nentries + 1) * 2 > builtin->table_size) grow_count_table(builtin);
+
+    uint64_t hash = hash_line(line, len);
+    size_t mask = builtin->table_size - 1;
+    size_t slot = hash & mask;
+    for (; builtin->table[slot]; slot = (slot + 1) & mask) {
+        CountEntry *entry = &builtin->entries[builtin->table[slot] - 1];
+        if (entry->hash == hash && entry->line.len == len
+            && memcmp(builtin->arena.buf + entry->line.offset, line, len) == 0) {
+            entry->count++;
+            return;
+        }
+    }
+
+    if (builtin->nentries == builtin->entries_bufsize) {
+        builtin->entries_bufsize = builtin->entries_bufsize ? builtin->entries_bufsize * 2 : 256;
+        builtin->entries = must_realloc(builtin->entries,
+                                        sizeof *builtin->entries * builtin->entries_bufsize);
+    }
+    CountEntry *entry = &builtin->entries[builtin->nentries++];
+    entry->line.offset = arena_add(&builtin->arena, line, len);
+    entry->line.len = len;
+    entry->hash = hash;
+    entry->count = 1;
+    builtin->table[slot] = builtin->nentries;
+}
+
+static void finish_count(Builtin *builtin) {
+    for (size_t i = 0; i < builtin->nentries; i++) {
+        CountEntry *entry = &builtin->entries[i];
+        emit_counted_line(builtin, entry->count, builtin->arena.buf + entry->line.offset,
+                          entry->line.len);
+    }
+}
+
+static void push_record(Builtin *builtin, Record *record) {
+    switch(builtin->kind) {
+        case GREP: push_grep(builtin, record); break;
+        case CUT: push_cut(builtin, record); break;
+        case SORT: push_sort(builtin, record->line, record->len); break;
+        case UNIQ: push_uniq(builtin, record->line, record->len); break;
+        case COUNT: push_count(builtin, record->line, record->len); break;
+        case RECORDS: push_records(builtin, record); break;
+    }
+}
+
+/*
+ * Passes the names of the fields along, ahead of any records. Stages that
+ * hold records back (sort, uniq, count) let it straight through, so it's
+ * still the first line out.
+ */
+static void push_header(Builtin *builtin, Record *names) {
+    Record out;
+    switch(builtin->kind) {
+        case GREP:
+            split_record(builtin, names, get_delim(builtin, names));
+            resolve_accessors(builtin, names);
+            break;
+        case CUT:
+            split_record(builtin, names, get_delim(builtin, names));
+            resolve_accessors(builtin, names);
+            if (cut_record(builtin, names, &out)) names = &out;
+            break;
+        case SORT:
+        case UNIQ:
+        case COUNT:
+        case RECORDS:
+            break;
+    }
+    emit_header(builtin, names);
+}
+
+static void finish_builtin(Builtin *builtin) {
+    switch(builtin->kind) {
+        case GREP:
+            // Like grep, selecting nothing is a failure
+            if (builtin->nmatched == 0) builtin->code = 1;
+            break;
+        case CUT:
+        case RECORDS:
+            break;
+        case SORT: finish_sort(builtin); break;
+        case UNIQ: finish_uniq(builtin); break;
+        case COUNT: finish_count(builtin); break;
+    }
+    if (builtin->next) finish_builtin(builtin->next);
+    else flush_output(builtin->out);
+}
+
+void run_builtins(char **argvs[], int nbuiltins, size_t sort_mem) {
+    assert(nbuiltins > 0);
+    Output *out = must_malloc(sizeof *out);
+    out->size = 0;
+
+    Builtin *builtins = calloc(nbuiltins, sizeof *builtins);
+    if (!builtins) die_no_mem();
+    for (int i = 0; i < nbuiltins; i++) {
+        assert(is_builtin_cmd(argvs[i]));
+        parse_builtin(&builtins[i], argvs[i]);
+        builtins[i].next = (i < nbuiltins - 1) ? &builtins[i + 1] : NULL;
+        builtins[i].out = out;
+        builtins[i].sort_mem = sort_mem;
+    }
+
+    size_t len;
+    char *line;
+    LineReader *reader = line_reader_create(STDIN_FILENO, '\n');
+    while ((line = line_reader_next(reader, &len)) != NULL) {
+        Record record = { .line = line, .len = len, .starts = NULL };
+        push_record(&builtins[0], &record);
+    }
+    destroy_line_reader(reader);
+
+    finish_builtin(&builtins[0]);
+    _exit(builtins[nbuiltins - 1].code);
+}
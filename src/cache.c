@@ -0,0 +1,396 @@
+#define _GNU_SOURCE  // O_TMPFILE
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "context.h"
+#include "errors.h"
+#include "exec.h"
+#include "utils.h"
+
+#define CACHE_MAX_SIZE (256LL << 20)
+#define CACHE_PATH_SIZE 4096
+#define CACHE_KEY_SIZE 33    // 128 bit hex plus null terminator
+#define CACHE_HEADER_SIZE 4  // "%03d\n" exit code
+#define HASH_BUF_SIZE (1 << 16)
+
+#define CACHED_ANNOTATION "cached"
+#define CACHED_INPUT_OPT "--input="
+
+extern char **environ;
+
+__extension__ typedef unsigned __int128 hash_t;
+
+typedef struct CacheEntry {
+    char name[CACHE_KEY_SIZE];
+    off_t size;
+    struct timespec mtime;
+} CacheEntry;
+
+// FNV-1a, 128 bit
+static void hash_bytes(hash_t *hash, const void *data, size_t size) {
+    const hash_t prime = ((hash_t) 1 << 88) + 0x13B;
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < size; i++) *hash = (*hash ^ bytes[i]) * prime;
+}
+
+static void hash_str(hash_t *hash, const char *str) {
+    hash_bytes(hash, str, strlen(str) + 1);  // Keep the null as a separator
+}
+
+bool is_cached_pipeline(EnvStack *stack) {
+    char **argv = get_env(stack)->argv;
+    return strcmp(argv[0], CACHED_ANNOTATION) == 0;
+}
+
+char **strip_cached_annotation(EnvStack *stack) {
+    assert(is_cached_pipeline(stack));
+    char **argv = get_env(stack)->argv;
+    int argc = 0;
+    while (argv[argc] != NULL) argc++;
+
+    char **inputs = must_malloc(sizeof *inputs * argc);
+    int ninputs = 0;
+    int skip = 1;
+    must_free(argv[0]);
+    for (; skip < argc; skip++) {
+        if (strncmp(argv[skip], CACHED_INPUT_OPT, strlen(CACHED_INPUT_OPT)) != 0) break;
+        inputs[ninputs++] = argv[skip];
+    }
+    inputs[ninputs] = NULL;
+
+    memmove(argv, argv + skip, sizeof *argv * (argc - skip + 1));
+
+    // The glob matches that can be split moved along with the rest, unless
+    // they were the options'
+    Env *env = get_env(stack);
+    if (env->split_start != -1 && env->split_start < skip) env->split_start = env->split_end = -1;
+    else if (env->split_start != -1) {
+        env->split_start -= skip;
+        env->split_end -= skip;
+    }
+    return inputs;
+}
+
+/*
+ * Hashes stdin from where it currently is. Regular files are rewound after,
+ * pipes are spooled to an unlinked file in dir that replaces stdin and
+ * devices (i.e. /dev/null) aren't read. Returns false if stdin can't be
+ * hashed.
+ */
+static bool hash_stdin(hash_t *hash, char *dir) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == -1) return false;
+    if (S_ISCHR(st.st_mode)) return true;
+    bool regular = S_ISREG(st.st_mode);
+    if (!regular && !S_ISFIFO(st.st_mode) && !S_ISSOCK(st.st_mode)) return false;
+
+    off_t start = 0;
+    int spool = -1;
+    if (regular) start = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    else {
+        spool = open(dir, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+        if (spool == -1) return false;
+    }
+
+    char buf[HASH_BUF_SIZE];
+    ssize_t nread;
+    while ((nread = read(STDIN_FILENO, buf, sizeof buf)) != 0) {
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread == -1) die_errno("Failed to read stdin");
+        hash_bytes(hash, buf, nread);
+        if (spool != -1 && write(spool, buf, nread) != nread)
+            die_errno("Failed to spool stdin");
+    }
+
+    if (regular) lseek(STDIN_FILENO, start, SEEK_SET);
+    else {
+        lseek(spool, 0, SEEK_SET);
+        dup2(spool, STDIN_FILENO);
+        close(spool);
+    }
+    return true;
+}
+
+static bool make_cache_key(EnvStack *stack, int ncmds, char *inputs[], char *dir,
+                           char key[CACHE_KEY_SIZE]) {
+    hash_t hash = ((hash_t) 0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL;
+    hash_str(&hash, "plsh-cache-v1");
+
+    char cwd[CACHE_PATH_SIZE];
+    if (!getcwd(cwd, sizeof cwd)) return false;
+    hash_str(&hash, cwd);
+
+    // Every stage, top of the stack is the first one
+    for (int i = 0; i < ncmds; i++) {
+        char **argv = stack->env_stack[stack->nstacks - 1 - i]->argv;
+        for (int j = 0; argv[j] != NULL; j++) hash_str(&hash, argv[j]);
+        hash_str(&hash, "|");
+    }
+
+    for (int i = 0; environ[i] != NULL; i++) hash_str(&hash, environ[i]);
+    hash_str(&hash, "");
+
+    struct stat st;
+    for (int i = 0; inputs[i] != NULL; i++) {
+        char *path = inputs[i] + strlen(CACHED_INPUT_OPT);
+        hash_str(&hash, path);
+        if (stat(path, &st) == -1) continue;
+        hash_bytes(&hash, &st.st_mtim, sizeof st.st_mtim);
+        hash_bytes(&hash, &st.st_size, sizeof st.st_size);
+    }
+
+    if (!hash_stdin(&hash, dir)) return false;
+
+    snprintf(key, CACHE_KEY_SIZE, "%016llx%016llx", (unsigned long long) (hash >> 64),
+             (unsigned long long) hash);
+    return true;
+}
+
+static char *get_cache_dir(EnvStack *stack) {
+    char path[CACHE_PATH_SIZE];
+    char *dir = get_stack_var(stack, "PLSH_CACHE_DIR");
+    char *base;
+    if (dir && *dir != '\0') snprintf(path, sizeof path, "%s", dir);
+    else if ((base = getenv("XDG_CACHE_HOME")) && *base != '\0')
+        snprintf(path, sizeof path, "%s/plsh", base);
+    else if ((base = getenv("HOME")) && *base != '\0')
+        snprintf(path, sizeof path, "%s/.cache/plsh", base);
+    else return NULL;
+
+    // Create each missing parent along the way
+    for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0700);
+        *slash = '/';
+    }
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) return NULL;
+    return must_strdup(path);
+}
+
+static long long get_cache_max(EnvStack *stack) {
+    char *max = get_stack_var(stack, "PLSH_CACHE_MAX");
+    if (!max || *max == '\0') return CACHE_MAX_SIZE;
+
+    char *end;
+    long long size = strtoll(max, &end, 10);
+    if (*end != '\0' || size < 0) return CACHE_MAX_SIZE;
+    return size;
+}
+
+/*
+ * Adds to the hit, miss and eviction counts kept in the cache's stats file.
+ */
+static void update_cache_stats(int dir_fd, int hits, int misses, int evictions) {
+    int fd = openat(dir_fd, "stats", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return;
+    flock(fd, LOCK_EX);
+
+    char buf[256] = {0};
+    long long nhits = 0, nmisses = 0, nevictions = 0;
+    if (pread(fd, buf, sizeof buf - 1, 0) > 0)
+        sscanf(buf, "hits %lld misses %lld evictions %lld", &nhits, &nmisses, &nevictions);
+
+    int len = snprintf(buf, sizeof buf, "hits %lld\nmisses %lld\nevictions %lld\n",
+                       nhits + hits, nmisses + misses, nevictions + evictions);
+    if (pwrite(fd, buf, len, 0) == len) ftruncate(fd, len);
+    close(fd);  // Drops the lock
+}
+
+static void copy_to_stdout(int fd, off_t offset, off_t size) {
+    fflush(stdout);
+    while (offset < size) {
+        ssize_t sent = sendfile(STDOUT_FILENO, fd, &offset, size - offset);
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent > 0) continue;
+
+        // sendfile can't write to everything (e.g. O_APPEND files)
+        char buf[HASH_BUF_SIZE];
+        ssize_t nread;
+        while ((nread = pread(fd, buf, sizeof buf, offset)) > 0) {
+            if (write(STDOUT_FILENO, buf, nread) != nread) return;
+            offset += nread;
+        }
+        return;
+    }
+}
+
+static bool serve_cache_entry(int dir_fd, char *key, exit_t *code) {
+    int fd = openat(dir_fd, key, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    char header[CACHE_HEADER_SIZE + 1] = {0};
+    struct stat st;
+    if (fstat(fd, &st) == -1 || pread(fd, header, CACHE_HEADER_SIZE, 0) != CACHE_HEADER_SIZE) {
+        close(fd);
+        return false;
+    }
+    *code = atoi(header);
+
+    // Mark as recently used for eviction
+    futimens(fd, NULL);
+    copy_to_stdout(fd, CACHE_HEADER_SIZE, st.st_size);
+    close(fd);
+    return true;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const CacheEntry *left = a;
+    const CacheEntry *right = b;
+    if (left->mtime.tv_sec != right->mtime.tv_sec)
+        return left->mtime.tv_sec < right->mtime.tv_sec ? -1 : 1;
+    if (left->mtime.tv_nsec != right->mtime.tv_nsec)
+        return left->mtime.tv_nsec < right->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Removes the least recently used entries until the cache fits in max bytes.
+ * Returns the number evicted.
+ */
+static int evict_cache_entries(int dir_fd, long long max) {
+    int fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir) {
+        if (fd != -1) close(fd);
+        return 0;
+    }
+
+    CacheEntry *entries = NULL;
+    size_t nentries = 0;
+    long long total = 0;
+    struct dirent *dent;
+    struct stat st;
+    while ((dent = readdir(dir)) != NULL) {
+        // Only entries are named by a full key
+        if (strlen(dent->d_name) != CACHE_KEY_SIZE - 1) continue;
+        if (fstatat(dir_fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+
+        entries = must_realloc(entries, sizeof *entries * (nentries + 1));
+        strcpy(entries[nentries].name, dent->d_name);
+        entries[nentries].size = st.st_size;
+        entries[nentries].mtime = st.st_mtim;
+        total += st.st_size;
+        nentries++;
+    }
+    closedir(dir);
+
+    int nevicted = 0;
+    qsort(entries, nentries, sizeof *entries, compare_entries);
+    for (size_t i = 0; i < nentries && total > max; i++) {
+        if (unlinkat(dir_fd, entries[i].name, 0) == -1) continue;
+        total -= entries[i].size;
+        nevicted++;
+    }
+    must_free(entries);
+    return nevicted;
+}
+
+/*
+ * Runs the pipeline with stdout going into a new cache entry, then copies the
+ * entry to the real stdout. Only successful runs are kept, a failure (not
+ * found, timed out, killed) says nothing about what the next run would do.
+ */
+static Result *run_into_cache_entry(EnvStack *stack, int ncmds, char *dir, char *key,
+                                    long long max) {
+    char tmp_path[CACHE_PATH_SIZE];
+    char path[CACHE_PATH_SIZE];
+    snprintf(tmp_path, sizeof tmp_path, "%s/tmp.XXXXXX", dir);
+    snprintf(path, sizeof path, "%s/%s", dir, key);
+
+    int saved_stdout = -1;
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd != -1) saved_stdout = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1 || saved_stdout == -1) {
+        if (fd != -1) {
+            unlink(tmp_path);
+            close(fd);
+        }
+        return pipeline_cmds(stack, ncmds);
+    }
+
+    // Reserve the header; the stages share this file offset and append after
+    char header[CACHE_HEADER_SIZE + 1];
+    write(fd, "000\n", CACHE_HEADER_SIZE);
+    fflush(stdout);
+    dup2(fd, STDOUT_FILENO);
+    Result *result = pipeline_cmds(stack, ncmds);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    snprintf(header, sizeof header, "%03d\n", result->code & 0xff);
+    pwrite(fd, header, CACHE_HEADER_SIZE, 0);
+
+    struct stat st;
+    bool stored = fstat(fd, &st) == 0;
+    if (stored) copy_to_stdout(fd, CACHE_HEADER_SIZE, st.st_size);
+    close(fd);
+
+    // Too big to keep, it would just evict everything else
+    if (stored && result->code == 0 && st.st_size <= max) rename(tmp_path, path);
+    else unlink(tmp_path);
+    return result;
+}
+
+Result *cached_pipeline_cmds(EnvStack *stack, int ncmds, char *inputs[]) {
+    assert(ncmds > 0);
+    assert(inputs);
+    assert(get_env(stack)->argv[0] != NULL);
+
+    // A cached command can't depend on what's typed in, so give it nothing
+    // rather than block hashing the terminal
+    int saved_stdin = -1;
+    int null_fd = isatty(STDIN_FILENO) ? open("/dev/null", O_RDONLY | O_CLOEXEC) : -1;
+    if (null_fd != -1) {
+        saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+
+    char key[CACHE_KEY_SIZE];
+    char *dir = get_cache_dir(stack);
+    int dir_fd = dir ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    bool keyed = dir_fd != -1 && make_cache_key(stack, ncmds, inputs, dir, key);
+    for (int i = 0; inputs[i] != NULL; i++) must_free(inputs[i]);
+    must_free(inputs);
+
+    exit_t code;
+    Result *result;
+    long long max = get_cache_max(stack);
+    if (!keyed) {
+        // Uncacheable (e.g. no cache directory), just run it
+        result = pipeline_cmds(stack, ncmds);
+    }
+    else if (serve_cache_entry(dir_fd, key, &code)) {
+        for (int i = 0; i < ncmds; i++) pop_stack(stack);
+        result = create_cmd_result("", code, STDOUT_FILENO);
+        update_cache_stats(dir_fd, 1, 0, 0);
+    }
+    else {
+        result = run_into_cache_entry(stack, ncmds, dir, key, max);
+        update_cache_stats(dir_fd, 0, 1, evict_cache_entries(dir_fd, max));
+    }
+    if (dir_fd != -1) close(dir_fd);
+    must_free(dir);
+
+    // All of stdin went into the key, so it's consumed whether or not the
+    // stages read it, otherwise what follows would see different input on a
+    // hit than on a miss
+    if (keyed) lseek(STDIN_FILENO, 0, SEEK_END);
+
+    if (saved_stdin != -1) {
+        dup2(saved_stdin, STDIN_FILENO);
+        close(saved_stdin);
+    }
+    return result;
+}
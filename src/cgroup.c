@@ -0,0 +1,149 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <linux/magic.h>
+#include <linux/sched.h>
+
+#include "cgroup.h"
+#include "errors.h"
+#include "utils.h"
+
+#define CGROUP_PATH_SIZE 4096
+
+// Set once clone3 into a cgroup has failed, fork and join instead from then on
+static bool no_clone_into_cgroup = false;
+
+// Warn only once, a script can run many pipelines against the same cgroup
+static bool warned = false;
+
+static void warn_cgroup(char *msg, char *path) {
+    if (warned) return;
+    warned = true;
+    fprintf(stderr, "%s %s: %s (further cgroup warnings suppressed)\n", msg, path,
+            strerror(errno));
+}
+
+static bool write_cgroup_file(int dir_fd, char *name, char *value) {
+    int fd = openat(dir_fd, name, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    ssize_t written = write(fd, value, strlen(value));
+    close(fd);
+    return written == (ssize_t) strlen(value);
+}
+
+static FILE *open_cgroup_file(int dir_fd, char *name) {
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    FILE *file = fdopen(fd, "r");
+    if (!file) close(fd);
+    return file;
+}
+
+Cgroup *create_cgroup(char *parent, char *cpu_max, char *memory_max) {
+    assert(parent);
+    static int ncreated = 0;
+    char path[CGROUP_PATH_SIZE];
+    snprintf(path, sizeof path, "%s/plsh-%d-%d", parent, (int) getpid(), ncreated++);
+
+    // Anything else (cgroup v1, a plain directory) would take the mkdir but
+    // can't hold processes
+    struct statfs fs;
+    if (statfs(parent, &fs) == -1) {
+        warn_cgroup("Cannot use cgroup", parent);
+        return NULL;
+    }
+    if (fs.f_type != CGROUP2_SUPER_MAGIC) {
+        errno = ENOTSUP;
+        warn_cgroup("Not a cgroup v2 directory", parent);
+        return NULL;
+    }
+
+    if (mkdir(path, 0755) == -1) {
+        warn_cgroup("Cannot create cgroup", path);
+        return NULL;
+    }
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        warn_cgroup("Cannot open cgroup", path);
+        rmdir(path);
+        return NULL;
+    }
+
+    // Limits are best effort, the controllers might not be delegated to us
+    if (cpu_max && !write_cgroup_file(dir_fd, "cpu.max", cpu_max))
+        warn_cgroup("Cannot set cpu.max in", path);
+    if (memory_max && !write_cgroup_file(dir_fd, "memory.max", memory_max))
+        warn_cgroup("Cannot set memory.max in", path);
+
+    Cgroup *cgroup = must_malloc(sizeof *cgroup);
+    cgroup->path = must_strdup(path);
+    cgroup->dir_fd = dir_fd;
+    return cgroup;
+}
+
+void destroy_cgroup(Cgroup *cgroup) {
+    if (!cgroup) return;
+    close(cgroup->dir_fd);
+    rmdir(cgroup->path);
+    must_free(cgroup->path);
+    must_free(cgroup);
+}
+
+pid_t fork_into_cgroup(Cgroup *cgroup, bool exec_only) {
+    if (!cgroup) return fork();
+
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    // A raw clone3 skips glibc's fork handlers, leaving malloc and stdio
+    // locks as they were, which only a child that goes straight to exec can
+    // get away with
+    if (exec_only && !no_clone_into_cgroup) {
+        struct clone_args args = {0};
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = cgroup->dir_fd;
+
+        pid_t pid = syscall(SYS_clone3, &args, sizeof args);
+        if (pid != -1) return pid;
+        no_clone_into_cgroup = true;
+    }
+#endif
+
+    pid_t pid = fork();
+    if (pid == 0 && !write_cgroup_file(cgroup->dir_fd, "cgroup.procs", "0"))
+        warn_cgroup("Cannot join cgroup", cgroup->path);
+    return pid;
+}
+
+void read_cgroup_stats(Cgroup *cgroup, long long *mem_peak, long long *cpu_usec) {
+    assert(cgroup);
+    *mem_peak = -1;
+    *cpu_usec = -1;
+
+    FILE *file = open_cgroup_file(cgroup->dir_fd, "memory.peak");
+    if (file) {
+        if (fscanf(file, "%lld", mem_peak) != 1) *mem_peak = -1;
+        fclose(file);
+    }
+
+    file = open_cgroup_file(cgroup->dir_fd, "cpu.stat");
+    if (file) {
+        char key[64];
+        long long value;
+        while (fscanf(file, "%63s %lld", key, &value) == 2) {
+            if (strcmp(key, "usage_usec") == 0) {
+                *cpu_usec = value;
+                break;
+            }
+        }
+        fclose(file);
+    }
+}
@@ -10,11 +10,14 @@
 #include "context.h"
 #include "errors.h"
 #include "exec.h"
+#include "memstats.h"
 #include "utils.h"
+#include "watch.h"
 
 #define RESULT_BUF_SIZE 32
 
 void push_stack(EnvStack *stack, char *argv[]) {
+    MemSubsystem previous = mem_stats_enter(MEM_ENV_STACK);
     if (!stack) {
         stack = must_malloc(sizeof *stack);
         stack->env_stack = NULL;
@@ -25,11 +28,15 @@ void push_stack(EnvStack *stack, char *argv[]) {
 
     Env *new = must_malloc(sizeof *new);
     new->argv = argv;
+    new->split_start = -1;
+    new->split_end = -1;
+    new->deadline_ms = -1;
     new->names = NULL;
     new->values = NULL;
     new->nvals = 0;
     stack->env_stack[stack->nstacks] = new;
     stack->nstacks++;
+    mem_stats_leave(previous);
 }
 
 void push_stack_from_prev(EnvStack *stack) {
@@ -46,18 +53,20 @@ void pop_stack(EnvStack *stack) {
 
     Env *toremove = stack->env_stack[stack->nstacks - 1];
     char **argv = toremove->argv;
-    for (int i = 0; argv[i] != NULL; i++) free(argv[i]);
-    free(argv);
+    for (int i = 0; argv[i] != NULL; i++) must_free(argv[i]);
+    must_free(argv);
     for (int i = 0; i < toremove->nvals; i++) {
-        free(toremove->names[i]);
-        free(toremove->values[i]);
+        must_free(toremove->names[i]);
+        must_free(toremove->values[i]);
     }
-    free(toremove->names);
-    free(toremove->values);
-    free(toremove);
+    must_free(toremove->names);
+    must_free(toremove->values);
+    must_free(toremove);
     stack->nstacks--;
+    MemSubsystem previous = mem_stats_enter(MEM_ENV_STACK);
     stack->env_stack = must_realloc(stack->env_stack,
                                sizeof(*(stack->env_stack)) * stack->nstacks);
+    mem_stats_leave(previous);
 }
 
 Env * get_env(EnvStack *stack) {
@@ -68,6 +77,7 @@ Env * get_env(EnvStack *stack) {
 
 char *get_stack_var(EnvStack *stack, char *name) {
     assert(stack);
+    watch_note_var(name, false);
     for (int i = stack->nstacks - 1; i >= 0; i--) {
         Env *curr = stack->env_stack[i];
         for (int j = 0; j < curr->nvals; j++)
@@ -79,6 +89,8 @@ char *get_stack_var(EnvStack *stack, char *name) {
 void add_stack_var(EnvStack *stack, char *name, char *value) {
     assert(stack);
     assert(stack->nstacks > 0);
+    watch_note_var(name, true);
+    MemSubsystem previous = mem_stats_enter(MEM_ENV_STACK);
     int top_index = stack->nstacks - 1;
 
     // Search for existing stack variables
@@ -87,7 +99,9 @@ void add_stack_var(EnvStack *stack, char *name, char *value) {
         curr = stack->env_stack[i];
         for (int j = 0; j < curr->nvals; j++) {
             if (strcmp(curr->names[j], name) == 0) {
-                curr->values[j] = value;
+                must_free(curr->values[j]);
+                curr->values[j] = must_strdup(value);
+                mem_stats_leave(previous);
                 return;
             }
         }
@@ -95,12 +109,12 @@ void add_stack_var(EnvStack *stack, char *name, char *value) {
 
     // If none, add a new variable
     Env *top = stack->env_stack[top_index];
-    top->names = must_realloc(top->names, sizeof *(top->names) * top->nvals + 1);
+    top->names = must_realloc(top->names, sizeof *(top->names) * (top->nvals + 1));
     top->names[top->nvals] = must_strdup(name);
-    top->values = must_realloc(top->values, sizeof *(top->values) * top->nvals + 1);
+    top->values = must_realloc(top->values, sizeof *(top->values) * (top->nvals + 1));
     top->values[top->nvals] = must_strdup(value);
     top->nvals++;
-    return;
+    mem_stats_leave(previous);
 }
 
 exit_t get_last_exit_code(EnvStack *stack) {
@@ -118,6 +132,7 @@ char peek_char(FILE *stream) {
 
 char seek_until_chars(FILE *stream, char *result[], char *stop) {
     assert(result);
+    MemSubsystem previous = mem_stats_enter(MEM_LEXER);
     StrBuilder *build = str_build_create();
 
     char c;
@@ -129,7 +144,8 @@ char seek_until_chars(FILE *stream, char *result[], char *stop) {
 
 finish:
     *result = str_build_to_str(build);
-    destroy_str_build(build);
+    must_free(build);  // The buffer is the result now
+    mem_stats_leave(previous);
     return c;  // Restore the stop char
 }
 
@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "errors.h"
 
@@ -38,6 +39,11 @@ void die_errno(char *msg) {
     exit(1);
 }
 
+void die_child_errno(char *msg) {
+    perror(msg);
+    _exit(1);
+}
+
 void die_no_mem() {
     errno = ENOMEM;
     perror("");
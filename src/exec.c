@@ -1,27 +1,80 @@
+#define _GNU_SOURCE  // memfd_create, F_ADD_SEALS
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
+#include "builtins.h"
+#include "cgroup.h"
 #include "context.h"
 #include "errors.h"
 #include "exec.h"
+#include "memstats.h"
 #include "utils.h"
 
 #define IN 0
 #define OUT 1
 
+#define READ_BUF_SIZE (1 << 16)
+
+// Pieces of an echo handed to each writev, well under IOV_MAX
+#define VALUE_IOV_SIZE 256
+
+// Default time (ms) upstream stages get to exit after the last stage has
+#define PIPE_GRACE_MS 100
+
+// Room left for the kernel's own use of the argv/envp space (as xargs does)
+#define ARG_HEADROOM 2048
+#define ARG_MAX_FALLBACK (128 * 1024)
+
+// Memory a builtin sort buffers before spilling runs to temp files
+#define SORT_MEM_SIZE (64LL << 20)
+
+// What a pipeline exits with if it ran out of time (as timeout(1) does)
+#define TIMEOUT_EXIT_CODE 124
+
+extern char **environ;
+
+typedef struct Deadline {
+    int fd;          // timerfd, or -1 if not armed
+    pid_t target;    // Stage pid, or the negated process group
+    pid_t pgid;      // Group the stage's descendants are looked for in
+    pid_t *tree;     // The stage and its descendants as of the last signal
+    size_t ntree;
+    int nsignals;    // How far along SIGTERM, SIGKILL it's got
+} Deadline;
+
+typedef struct Proc {
+    pid_t pid;
+    pid_t ppid;
+    bool in_tree;
+} Proc;
+
 // Used for blocking SIGCHLD
 static sigset_t blocked;
 
 Result *create_cmd_result(char *output, exit_t code, int out_fd) {
+    MemSubsystem previous = mem_stats_enter(MEM_RESULT);
     Result *result = must_malloc(sizeof *result);
     result->output = must_strdup(output);
+    mem_stats_leave(previous);
     result->code = code;
     result->out_fd = out_fd;
+    result->mem_peak = -1;
+    result->cpu_usec = -1;
     return result;
 }
 
@@ -34,77 +87,619 @@ Result *create_empty_result() {
 }
 
 void destroy_result(Result *result) {
-    free(result->output);
+    must_free(result->output);
     if (result->out_fd != STDOUT_FILENO) close(result->out_fd);
-    free(result);
+    must_free(result);
+}
+
+static long get_pipe_grace_ms(EnvStack *stack) {
+    char *grace = get_stack_var(stack, "PLSH_PIPE_GRACE");
+    if (!grace || *grace == '\0') return PIPE_GRACE_MS;
+
+    char *end;
+    long ms = strtol(grace, &end, 10);
+    if (*end != '\0' || ms < 0) return PIPE_GRACE_MS;
+    return ms;
+}
+
+/*
+ * Returns whether the stage is an echo that only has words to print, which
+ * can be written straight to the next stage's stdin.
+ */
+static bool is_plain_echo(char *argv[]) {
+    if (strcmp(argv[0], "echo") != 0) return false;
+    for (int i = 1; argv[i] != NULL; i++) if (argv[i][0] == '-') return false;
+    return true;
+}
+
+static int get_split_jobs(EnvStack *stack) {
+    char *jobs = get_stack_var(stack, "PLSH_ARG_SPLIT");
+    if (!jobs || *jobs == '\0') return 0;
+
+    char *end;
+    long njobs = strtol(jobs, &end, 10);
+    if (*end != '\0' || njobs < 0) return 0;
+    return njobs;
+}
+
+static size_t get_sort_mem(EnvStack *stack) {
+    char *mem = get_stack_var(stack, "PLSH_SORT_MEM");
+    if (!mem || *mem == '\0') return SORT_MEM_SIZE;
+
+    char *end;
+    long long size = strtoll(mem, &end, 10);
+    if (*end != '\0' || size <= 0) return SORT_MEM_SIZE;
+    return size;
+}
+
+static size_t arg_size(char *arg) {
+    return strlen(arg) + 1 + sizeof arg;
+}
+
+/*
+ * Returns how many bytes of argv (strings and pointers) exec will take, after
+ * the environment has taken its share.
+ */
+static size_t get_arg_max() {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) arg_max = ARG_MAX_FALLBACK;
+
+    size_t used = ARG_HEADROOM + sizeof *environ;
+    for (char **env = environ; *env != NULL; env++) used += arg_size(*env);
+    return (size_t) arg_max > used ? arg_max - used : 0;
+}
+
+static void copy_fd(int from, int to) {
+    char buf[READ_BUF_SIZE];
+    ssize_t nread;
+    off_t offset = 0;
+    while ((nread = pread(from, buf, sizeof buf, offset)) != 0) {
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread == -1) die_child_errno("Failed to read");
+        for (ssize_t written = 0, n; written < nread; written += n) {
+            n = write(to, buf + written, nread - written);
+            if (n == -1 && errno == EINTR) n = 0;
+            else if (n == -1) die_child_errno("Failed to write");
+        }
+        offset += nread;
+    }
+}
+
+/*
+ * Runs argv as however many invocations it takes for each to fit in the
+ * kernel's limit, splitting up argv[split_start:split_end] between them
+ * (everything else is passed to each). At most jobs invocations run at once
+ * and their output is written in order. Exits with the first failing code.
+ */
+static void exec_split(char *argv[], int split_start, int split_end, int jobs) {
+    size_t limit = get_arg_max();
+    int argc = 0;
+    while (argv[argc] != NULL) argc++;
+
+    size_t fixed = sizeof *argv;  // NULL terminator
+    for (int i = 0; i < argc; i++)
+        if (i < split_start || i >= split_end) fixed += arg_size(argv[i]);
+
+    // Greedily fill each invocation up to the limit
+    int *starts = must_malloc(sizeof *starts * (split_end - split_start + 1));
+    int nchunks = 0;
+    int max_chunk = 0;
+    size_t size = fixed;
+    starts[0] = split_start;
+    for (int i = split_start; i < split_end; i++) {
+        if (size + arg_size(argv[i]) > limit && i > starts[nchunks]) {
+            if (i - starts[nchunks] > max_chunk) max_chunk = i - starts[nchunks];
+            starts[++nchunks] = i;
+            size = fixed;
+        }
+        if (size + arg_size(argv[i]) > limit) {
+            errno = E2BIG;
+            die_child_errno(argv[0]);
+        }
+        size += arg_size(argv[i]);
+    }
+    if (split_end - starts[nchunks] > max_chunk) max_chunk = split_end - starts[nchunks];
+    starts[++nchunks] = split_end;
+
+    int nfixed = argc - (split_end - split_start);
+    char **chunk_argv = must_malloc(sizeof *chunk_argv * (nfixed + max_chunk + 1));
+    pid_t *pids = must_malloc(sizeof *pids * nchunks);
+    FILE **outs = must_malloc(sizeof *outs * nchunks);
+    bool *done = must_malloc(sizeof *done * nchunks);
+    int devnull = open("/dev/null", O_RDONLY);
+    exit_t code = 0;
+    int next = 0, emit = 0, running = 0;
+
+    while (emit < nchunks) {
+        while (running < jobs && next < nchunks) {
+            // Only the chunk whose output is due can write straight through,
+            // the ones after it are held in temp files until it's their turn
+            outs[next] = NULL;
+            if (next != emit && !(outs[next] = tmpfile()))
+                die_child_errno("Failed to buffer output");
+            done[next] = false;
+
+            pids[next] = fork();
+            if (pids[next] == -1) die_child_errno("Failed to fork");
+            if (pids[next] == 0) {
+                // Like xargs, the invocations don't compete for our stdin
+                if (devnull != -1) dup2(devnull, STDIN_FILENO);
+                if (outs[next]) dup2(fileno(outs[next]), STDOUT_FILENO);
+
+                int n = 0;
+                for (int i = 0; i < split_start; i++) chunk_argv[n++] = argv[i];
+                for (int i = starts[next]; i < starts[next + 1]; i++) chunk_argv[n++] = argv[i];
+                for (int i = split_end; i < argc; i++) chunk_argv[n++] = argv[i];
+                chunk_argv[n] = NULL;
+                execvp(chunk_argv[0], chunk_argv);
+                die_child_errno(chunk_argv[0]);
+            }
+            running++;
+            next++;
+        }
+
+        int status;
+        pid_t dead_pid = waitpid(-1, &status, 0);
+        if (dead_pid == -1) die_child_errno("Failed to wait");
+        for (int i = 0; i < next; i++) {
+            if (dead_pid != pids[i]) continue;
+            done[i] = true;
+            running--;
+            if (code == 0 && WIFEXITED(status)) code = WEXITSTATUS(status);
+            if (code == 0 && WIFSIGNALED(status)) code = 128 + WTERMSIG(status);
+            break;
+        }
+
+        for (; emit < nchunks && done[emit]; emit++) {
+            if (!outs[emit]) continue;
+            copy_fd(fileno(outs[emit]), STDOUT_FILENO);
+            fclose(outs[emit]);
+        }
+    }
+    _exit(code);
+}
+
+static int reap_stage(pid_t pids[], bool alive[], int ncmds, pid_t dead_pid) {
+    for (int i = 0; i < ncmds; i++) {
+        if (alive[i] && dead_pid == pids[i]) {
+            alive[i] = false;
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void arm_deadline(Deadline *deadline, pid_t target, long ms) {
+    if (deadline->fd == -1) {
+        deadline->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (deadline->fd == -1) die_errno("Failed to create timer");
+    }
+    deadline->target = target;
+
+    // A zero it_value disarms the timer, so expire "now" instead
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+    if (ms <= 0) spec.it_value.tv_nsec = 1;
+    timerfd_settime(deadline->fd, 0, &spec, NULL);
+}
+
+static void disarm_deadline(Deadline *deadline) {
+    if (deadline->fd != -1) close(deadline->fd);
+    deadline->fd = -1;
+    must_free(deadline->tree);
+    deadline->tree = NULL;
+    deadline->ntree = 0;
+}
+
+/*
+ * Lists the processes in the group from /proc, or returns NULL if it can't be
+ * read.
+ */
+static Proc *list_group_procs(pid_t pgid, size_t *nprocs) {
+    DIR *proc_dir = opendir("/proc");
+    if (!proc_dir) return NULL;
+
+    Proc *procs = NULL;
+    *nprocs = 0;
+    char path[64];
+    char stat[512];
+    struct dirent *entry;
+    while ((entry = readdir(proc_dir))) {
+        pid_t pid = atoi(entry->d_name);
+        if (pid <= 0) continue;
+
+        snprintf(path, sizeof path, "/proc/%d/stat", pid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) continue;  // Gone already
+        ssize_t nread = read(fd, stat, sizeof stat - 1);
+        close(fd);
+        if (nread <= 0) continue;
+        stat[nread] = '\0';
+
+        // "pid (comm) state ppid pgrp ...", where comm may hold anything
+        char *comm_end = strrchr(stat, ')');
+        pid_t ppid, pgrp;
+        if (!comm_end || sscanf(comm_end + 1, " %*c %d %d", &ppid, &pgrp) != 2) continue;
+        if (pgrp != pgid) continue;
+
+        procs = must_realloc(procs, sizeof *procs * (*nprocs + 1));
+        procs[(*nprocs)++] = (Proc) { .pid = pid, .ppid = ppid, .in_tree = false };
+    }
+    closedir(proc_dir);
+    return procs;
+}
+
+/*
+ * Signals a stage along with everything it started, as signalling its pid
+ * alone would orphan them (e.g. a script's sleep, exec_split's invocations)
+ * still holding the pipes open. Descendants are remembered, so the next
+ * signal still finds them once the stage itself is gone.
+ */
+static void kill_stage_tree(Deadline *deadline, int sig) {
+    size_t nprocs;
+    Proc *procs = list_group_procs(deadline->pgid, &nprocs);
+    if (!procs) {
+        kill(deadline->target, sig);
+        return;
+    }
+
+    for (size_t i = 0; i < nprocs; i++) {
+        procs[i].in_tree = procs[i].pid == deadline->target;
+        for (size_t j = 0; j < deadline->ntree && !procs[i].in_tree; j++)
+            procs[i].in_tree = procs[i].pid == deadline->tree[j];
+    }
+    for (bool grew = true; grew;) {
+        grew = false;
+        for (size_t i = 0; i < nprocs; i++) {
+            for (size_t j = 0; j < nprocs && !procs[i].in_tree; j++) {
+                procs[i].in_tree = procs[j].in_tree && procs[j].pid == procs[i].ppid;
+                grew |= procs[i].in_tree;
+            }
+        }
+    }
+
+    deadline->ntree = 0;
+    for (size_t i = 0; i < nprocs; i++) {
+        if (!procs[i].in_tree) continue;
+        kill(procs[i].pid, sig);
+        deadline->tree = must_realloc(deadline->tree,
+                                      sizeof *deadline->tree * (deadline->ntree + 1));
+        deadline->tree[deadline->ntree++] = procs[i].pid;
+    }
+    must_free(procs);
+}
+
+static void send_deadline_signal(Deadline *deadline, int sig) {
+    if (deadline->target > 0) kill_stage_tree(deadline, sig);
+    else kill(deadline->target, sig);
+}
+
+/*
+ * Sends the next signal in the SIGTERM, SIGKILL escalation, giving the target
+ * the grace period to exit before the next one.
+ */
+static void expire_deadline(Deadline *deadline, long grace_ms) {
+    uint64_t nexpired;
+    if (read(deadline->fd, &nexpired, sizeof nexpired) != sizeof nexpired) return;
+
+    if (deadline->nsignals++ == 0) {
+        send_deadline_signal(deadline, SIGTERM);
+        arm_deadline(deadline, deadline->target, grace_ms);
+    }
+    else {
+        send_deadline_signal(deadline, SIGKILL);
+        disarm_deadline(deadline);
+    }
+}
+
+static bool in_foreground() {
+    return isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+}
+
+/*
+ * Moves the terminal to the given group from a process that may be in the
+ * background, so doesn't stop on SIGTTOU for it.
+ */
+static void set_terminal(pid_t pgid) {
+    sigset_t ttou, prev;
+    sigemptyset(&ttou);
+    sigaddset(&ttou, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &ttou, &prev);
+    tcsetpgrp(STDIN_FILENO, pgid);
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * Hands the terminal to the given process group if we were in the foreground
+ * before forking it, returning the group that should get it back (or -1 if
+ * untouched). Its stages may already have taken it, so we can't ask now.
+ */
+static pid_t give_terminal(pid_t pgid, bool foreground) {
+    if (!foreground || pgid <= 0) return -1;
+    set_terminal(pgid);
+    return getpgrp();
+}
+
+static void take_terminal(pid_t fg) {
+    if (fg != -1) set_terminal(fg);
+}
+
+/*
+ * A stage was stopped (e.g. ^Z, which only reaches the pipeline's group), so
+ * stop with it as we would have sharing its group, letting whatever runs us
+ * see the job stop. Once continued, so is the pipeline.
+ */
+static void suspend_pipeline(pid_t pgid, pid_t fg) {
+    take_terminal(fg);
+    raise(SIGSTOP);
+    if (fg != -1) set_terminal(pgid);
+    killpg(pgid, SIGCONT);
 }
 
 Result *pipeline_cmds(EnvStack *stack, int ncmds) {
     assert(ncmds > 0);
     exit_t code = 0;
     int fd[2];
-    int prev_fd = 0;
+    int prev_fd = STDIN_FILENO;
     pid_t pids[ncmds];
+    bool alive[ncmds];
+    pid_t pgid = 0;
+    long grace_ms = get_pipe_grace_ms(stack);
+    long pipe_deadline_ms = parse_duration_ms(get_stack_var(stack, "PLSH_DEADLINE"));
+    Deadline deadlines[ncmds + 2];  // A deadline per stage, the pipeline and teardown
+    for (int i = 0; i < ncmds + 2; i++)
+        deadlines[i] = (Deadline) { .fd = -1, .target = 0, .pgid = 0, .tree = NULL, .ntree = 0,
+                                    .nsignals = 0 };
+    int split_jobs = get_split_jobs(stack);
+    size_t sort_mem = get_sort_mem(stack);
+    int nalive = 0;
+    size_t arg_max = split_jobs > 0 ? get_arg_max() : 0;
+
+    Cgroup *cgroup = NULL;
+    char *cgroup_parent = get_stack_var(stack, "PLSH_CGROUP");
+    if (cgroup_parent && *cgroup_parent != '\0')
+        cgroup = create_cgroup(cgroup_parent, get_stack_var(stack, "PLSH_CPU_MAX"),
+                               get_stack_var(stack, "PLSH_MEMORY_MAX"));
 
     // Block SIGCHLD signals from reaching parent until after we get to the
     // code to process signals. This way we can safely do a waitpid with the
     // assumption that the child hasn't sent a SIGCHLD before we could process
     // it.
+    sigemptyset(&blocked);
     sigaddset(&blocked, SIGCHLD);
     sigprocmask(SIG_BLOCK, &blocked, NULL);
 
+    bool foreground = in_foreground();
     for (int i = 0; i < ncmds; i++) {
         Env *env = get_env(stack);
         char **argv = env->argv;
         assert(argv[0] != NULL);
+
+        // Nothing to run for an echo into the pipeline, its words are handed
+        // to the next stage as a file
+        if (i == 0 && ncmds > 1 && is_plain_echo(argv)) {
+            prev_fd = echo_to_fd(argv + 1);
+            pids[i] = -1;
+            alive[i] = false;
+            pop_stack(stack);
+            continue;
+        }
+
+        // A run of builtin stages is one process passing lines in memory, so
+        // it takes the slot of its last stage and the others are never alive
+        int nbuiltins = 0;
+        long deadline_ms = env->deadline_ms;
+        while (i + nbuiltins < ncmds) {
+            Env *stage = stack->env_stack[stack->nstacks - 1 - nbuiltins];
+            if (!is_builtin_cmd(stage->argv)) break;
+            if (stage->deadline_ms >= 0 && (deadline_ms < 0 || stage->deadline_ms < deadline_ms))
+                deadline_ms = stage->deadline_ms;
+            nbuiltins++;
+        }
+        int last = nbuiltins > 0 ? i + nbuiltins - 1 : i;
+        for (; i < last; i++) {
+            pids[i] = -1;
+            alive[i] = false;
+        }
+
+        // Only worth counting if we're allowed to do something about it
+        bool split = false;
+        if (split_jobs > 0 && nbuiltins == 0 && env->split_start != -1) {
+            size_t size = sizeof *argv;
+            for (int j = 0; argv[j] != NULL && size <= arg_max; j++) size += arg_size(argv[j]);
+            split = size > arg_max;
+        }
         // print_argv(argv);
         // TODO: Handle lambdas here (output = ...)
 
         pipe(fd);
-        pids[i] = fork();
+        // Builtins and split invocations run (and allocate) in the child
+        pids[i] = fork_into_cgroup(cgroup, nbuiltins == 0 && !split);
         if (pids[i] == -1) die_errno("Failed to fork");
         if (pids[i] == 0) {
-            // Child
-            dup2(prev_fd, STDIN_FILENO);
+            // Child: the whole pipeline shares one process group, led by the
+            // first stage, so it can be signalled as a unit. The group takes
+            // the terminal here too (the parent only does once all stages are
+            // forked), otherwise a stage reading it first stops on SIGTTIN
+            setpgid(0, pgid);
+            if (foreground) set_terminal(getpgrp());
+            signal(SIGPIPE, SIG_DFL);
+            sigprocmask(SIG_UNBLOCK, &blocked, NULL);
+
+            if (prev_fd != STDIN_FILENO) {
+                dup2(prev_fd, STDIN_FILENO);
+                close(prev_fd);
+            }
 
             // If next command, setup future pipe
             if (i < ncmds - 1) dup2(fd[OUT], STDOUT_FILENO);
 
             close(fd[IN]);
+            close(fd[OUT]);
+            if (nbuiltins > 0) {
+                char **argvs[nbuiltins];
+                for (int j = 0; j < nbuiltins; j++)
+                    argvs[j] = stack->env_stack[stack->nstacks - 1 - j]->argv;
+                run_builtins(argvs, nbuiltins, sort_mem);
+            }
+            if (split) exec_split(argv, env->split_start, env->split_end, split_jobs);
             if (execvp(argv[0], argv) == -1)
-                die_errno(argv[0]);
+                die_child_errno(argv[0]);
         }
         else {
-            // Parent
+            // Parent: also set the group here, otherwise we'd race the child
+            if (pgid == 0) pgid = pids[i];
+            setpgid(pids[i], pgid);
+            alive[i] = true;
+            nalive++;
+
+            // Don't hold on to pipe ends, otherwise upstream stages never see
+            // SIGPIPE once their reader is gone
             close(fd[OUT]);
+            if (prev_fd != STDIN_FILENO) close(prev_fd);
             prev_fd = fd[IN];
-            pop_stack(stack);
+            deadlines[i].pgid = pgid;
+            if (deadline_ms >= 0) arm_deadline(&deadlines[i], pids[i], deadline_ms);
+            for (int j = 0; j < (nbuiltins > 0 ? nbuiltins : 1); j++) pop_stack(stack);
         }
     }
 
-    // Unblock here
-    sigprocmask(SIG_UNBLOCK, &blocked, NULL);
+    pid_t fg = give_terminal(pgid, foreground);
 
+    // Everything is driven from one poll: SIGCHLD (through a signalfd, it's
+    // blocked) for reaping and a timerfd per deadline, so nothing is polled
+    // and no threads are needed
+    int sig_fd = signalfd(-1, &blocked, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd == -1) die_errno("Failed to create signalfd");
+
+    Deadline *pipe_deadline = &deadlines[ncmds];
+    Deadline *teardown = &deadlines[ncmds + 1];
+    if (pipe_deadline_ms >= 0) arm_deadline(pipe_deadline, -pgid, pipe_deadline_ms);
+
+    int ndeadlines = ncmds + 2;
+    struct pollfd pollfds[ndeadlines + 1];
+    int polled[ndeadlines + 1];
     int status;
+    int last_signal = 0;
     pid_t dead_pid;
-    int ndead = 0;
-    do {
-        dead_pid = waitpid(0, &status, WNOHANG | WUNTRACED);
-        if (dead_pid == -1) break;  // In case no dead children
-
-        // If last command, get exit code
-        if (WIFEXITED(status) && dead_pid == pids[ncmds - 1])
-            code = WEXITSTATUS(status);
-
-        // FIXME: Handle signals
-        // FIXME: Handle possability of core dump and other exit statuses
-
-        for (int j = 0; j < ncmds; j++) {
-            if (dead_pid == pids[j]) {
-                ndead++;
-                break;
+    for (;;) {
+        while (nalive > 0 && (dead_pid = waitpid(-pgid, &status, WNOHANG | WUNTRACED)) > 0) {
+            if (WIFSTOPPED(status)) {
+                suspend_pipeline(pgid, fg);
+                continue;
+            }
+            int stage = reap_stage(pids, alive, ncmds, dead_pid);
+            if (stage == -1) continue;
+            nalive--;
+            // A stage that ran out of time can leave descendants behind, which
+            // still need the rest of the escalation
+            if (deadlines[stage].nsignals == 0) disarm_deadline(&deadlines[stage]);
+            if (stage != ncmds - 1) continue;
+
+            // Last command, get exit code
+            if (WIFEXITED(status)) code = WEXITSTATUS(status);
+            else if (WIFSIGNALED(status)) code = 128 + (last_signal = WTERMSIG(status));
+            // Timed out if any stage did so far, even one the last stage
+            // outlived by just reading its EOF
+            for (int i = 0; i <= ncmds; i++) {
+                if (deadlines[i].nsignals > 0) code = TIMEOUT_EXIT_CODE;
             }
+
+            // Once the last stage is gone nobody reads what the upstream
+            // stages make, so give them a grace period to notice and then
+            // tear them down
+            disarm_deadline(pipe_deadline);
+            if (nalive > 0) arm_deadline(teardown, -pgid, grace_ms);
+        }
+        if (nalive == 0) break;
+
+        int npolled = 0;
+        pollfds[npolled] = (struct pollfd) { .fd = sig_fd, .events = POLLIN };
+        polled[npolled++] = -1;
+        for (int i = 0; i < ndeadlines; i++) {
+            if (deadlines[i].fd == -1) continue;
+            pollfds[npolled] = (struct pollfd) { .fd = deadlines[i].fd, .events = POLLIN };
+            polled[npolled++] = i;
+        }
+        if (poll(pollfds, npolled, -1) == -1) {
+            if (errno == EINTR) continue;
+            die_errno("Failed to poll");
+        }
+
+        struct signalfd_siginfo info;
+        for (int i = 0; i < npolled; i++) {
+            if (!(pollfds[i].revents & POLLIN)) continue;
+            if (polled[i] == -1)
+                while (read(sig_fd, &info, sizeof info) == sizeof info) continue;
+            else expire_deadline(&deadlines[polled[i]], grace_ms);
+        }
+    }
+    for (int i = 0; i < ndeadlines; i++) disarm_deadline(&deadlines[i]);
+    close(sig_fd);
+
+    take_terminal(fg);
+
+    // Unblock here
+    sigprocmask(SIG_UNBLOCK, &blocked, NULL);
+
+    Result *result = create_cmd_result("", code, prev_fd);
+    if (cgroup) {
+        read_cgroup_stats(cgroup, &result->mem_peak, &result->cpu_usec);
+        destroy_cgroup(cgroup);
+    }
+
+    // With the terminal handed over, a ^C (or ^\) only reached the pipeline,
+    // so die of it too rather than carry on with the script, as sh does
+    if (fg != -1 && (last_signal == SIGINT || last_signal == SIGQUIT)) {
+        signal(last_signal, SIG_DFL);
+        raise(last_signal);
+    }
+    return result;
+}
+
+/*
+ * Returns the given piece of an echo's output: its words at even pieces, each
+ * followed by a space, or a newline after the last.
+ */
+static struct iovec echo_piece(char *args[], int nargs, int piece) {
+    char *word = args[piece / 2];
+    if (piece % 2 == 0 && piece / 2 < nargs)
+        return (struct iovec) { .iov_base = word, .iov_len = strlen(word) };
+    return (struct iovec) { .iov_base = piece / 2 >= nargs - 1 ? "\n" : " ", .iov_len = 1 };
+}
+
+int echo_to_fd(char *args[]) {
+    // A sealed memfd can be mapped or read at the reader's own pace and,
+    // unlike a pipe, never needs a writer on the other end
+    int fd = memfd_create("plsh-value", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) fd = open(P_tmpdir, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+    if (fd == -1) die_errno("Failed to create value file");
+
+    // The words go straight from argv, a batch of pieces per writev
+    int nargs = 0;
+    while (args[nargs] != NULL) nargs++;
+    int npieces = nargs > 0 ? nargs * 2 : 1;
+    struct iovec iov[VALUE_IOV_SIZE];
+    size_t skip = 0;  // Of the first piece, written already
+    for (int piece = 0; piece < npieces;) {
+        int niov = 0;
+        for (; niov < VALUE_IOV_SIZE && piece + niov < npieces; niov++)
+            iov[niov] = echo_piece(args, nargs, piece + niov);
+        iov[0].iov_base = (char *) iov[0].iov_base + skip;
+        iov[0].iov_len -= skip;
+
+        ssize_t n = writev(fd, iov, niov);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) die_errno("Failed to write value file");
+        for (int i = 0; i < niov && (size_t) n >= iov[i].iov_len; i++, piece++) {
+            n -= iov[i].iov_len;
+            skip = 0;
         }
-    } while(ndead != ncmds);
-    return create_cmd_result("", code, prev_fd);
+        skip += n;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    return fd;
 }
@@ -0,0 +1,258 @@
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "errors.h"
+#include "expand.h"
+#include "utils.h"
+
+#define DENTS_BUF_SIZE (1 << 15)
+#define DIR_CACHE_SIZE 64
+
+// Not exported by glibc, see getdents64(2)
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct Matches {
+    char **paths;
+    size_t npaths;
+    size_t size;
+} Matches;
+
+DirCache *dir_cache_create() {
+    DirCache *cache = must_malloc(sizeof *cache);
+    cache->buckets = calloc(DIR_CACHE_SIZE, sizeof *cache->buckets);
+    if (!cache->buckets) die_no_mem();
+    cache->nbuckets = DIR_CACHE_SIZE;
+    cache->nlistings = 0;
+    return cache;
+}
+
+void destroy_dir_cache(DirCache *cache) {
+    assert(cache);
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        DirListing *listing = cache->buckets[i];
+        if (!listing) continue;
+        must_free(listing->path);
+        must_free(listing->names);
+        must_free(listing->offsets);
+        must_free(listing->types);
+        must_free(listing);
+    }
+    free(cache->buckets);
+    must_free(cache);
+}
+
+bool has_glob_chars(char *arg) {
+    assert(arg);
+    for (; *arg != '\0'; arg++) {
+        if (*arg == '\\' && arg[1] != '\0') arg++;
+        else if (*arg == '*' || *arg == '?' || *arg == '[') return true;
+    }
+    return false;
+}
+
+/*
+ * Reads the directory with getdents64 straight into the listing's buffers,
+ * avoiding readdir's per-entry copies and (thanks to d_type) any stat calls.
+ */
+static DirListing *read_dir_listing(char *path) {
+    int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    DirListing *listing = must_malloc(sizeof *listing);
+    listing->path = must_strdup(path);
+    listing->names = NULL;
+    listing->names_size = 0;
+    listing->offsets = NULL;
+    listing->types = NULL;
+    listing->nentries = 0;
+    if (fd == -1) return listing;  // Unreadable directories match nothing
+
+    char dents[DENTS_BUF_SIZE];
+    size_t names_bufsize = 0;
+    size_t entries_bufsize = 0;
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, dents, sizeof dents)) > 0) {
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64 *dent = (struct linux_dirent64 *) (dents + pos);
+            pos += dent->d_reclen;
+
+            char *name = dent->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+            size_t len = strlen(name) + 1;
+            if (listing->names_size + len > names_bufsize) {
+                names_bufsize = (listing->names_size + len) * 2;
+                listing->names = must_realloc(listing->names, names_bufsize);
+            }
+            if (listing->nentries == entries_bufsize) {
+                entries_bufsize = entries_bufsize ? entries_bufsize * 2 : 64;
+                listing->offsets = must_realloc(listing->offsets,
+                                                sizeof *listing->offsets * entries_bufsize);
+                listing->types = must_realloc(listing->types,
+                                              sizeof *listing->types * entries_bufsize);
+            }
+            memcpy(listing->names + listing->names_size, name, len);
+            listing->offsets[listing->nentries] = listing->names_size;
+            listing->types[listing->nentries] = dent->d_type;
+            listing->names_size += len;
+            listing->nentries++;
+        }
+    }
+    close(fd);
+    return listing;
+}
+
+static size_t hash_path(char *path) {
+    size_t hash = 14695981039346656037ULL;  // FNV-1a
+    for (; *path != '\0'; path++) hash = (hash ^ (unsigned char) *path) * 1099511628211ULL;
+    return hash;
+}
+
+static void grow_dir_cache(DirCache *cache) {
+    size_t old_nbuckets = cache->nbuckets;
+    DirListing **old_buckets = cache->buckets;
+
+    cache->nbuckets *= 2;
+    cache->buckets = calloc(cache->nbuckets, sizeof *cache->buckets);
+    if (!cache->buckets) die_no_mem();
+    for (size_t i = 0; i < old_nbuckets; i++) {
+        if (!old_buckets[i]) continue;
+        size_t j = hash_path(old_buckets[i]->path) & (cache->nbuckets - 1);
+        while (cache->buckets[j]) j = (j + 1) & (cache->nbuckets - 1);
+        cache->buckets[j] = old_buckets[i];
+    }
+    free(old_buckets);
+}
+
+static DirListing *get_dir_listing(DirCache *cache, char *path) {
+    size_t i = hash_path(path) & (cache->nbuckets - 1);
+    for (; cache->buckets[i]; i = (i + 1) & (cache->nbuckets - 1))
+        if (strcmp(cache->buckets[i]->path, path) == 0) return cache->buckets[i];
+
+    DirListing *listing = read_dir_listing(path);
+    cache->buckets[i] = listing;
+    if (++cache->nlistings * 2 > cache->nbuckets) grow_dir_cache(cache);
+    return listing;
+}
+
+static char *join_path(char *dir, char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    bool slash = dir_len > 0 && dir[dir_len - 1] != '/';
+
+    char *path = must_malloc(dir_len + slash + name_len + 1);
+    memcpy(path, dir, dir_len);
+    if (slash) path[dir_len] = '/';
+    memcpy(path + dir_len + slash, name, name_len + 1);
+    return path;
+}
+
+static bool is_dir(char *dir, char *name, unsigned char type, bool follow_links) {
+    if (type == DT_DIR) return true;
+    if (type == DT_LNK && !follow_links) return false;
+    if (type != DT_UNKNOWN && type != DT_LNK) return false;
+
+    // Only filesystems without d_type, and symlinks, need a stat
+    struct stat st;
+    char *path = join_path(dir, name);
+    int ret = follow_links ? stat(path, &st) : lstat(path, &st);
+    must_free(path);
+    return ret == 0 && S_ISDIR(st.st_mode);
+}
+
+static void add_match(Matches *matches, char *path) {
+    if (matches->npaths + 1 >= matches->size) {
+        matches->size = matches->size ? matches->size * 2 : 16;
+        matches->paths = must_realloc(matches->paths, sizeof *matches->paths * matches->size);
+    }
+    matches->paths[matches->npaths++] = path;
+}
+
+static void expand_parts(char *dir, char **parts, int nparts, DirCache *cache,
+                         Matches *matches) {
+    char *part = parts[0];
+    bool last = (nparts == 1);
+    DirListing *listing = get_dir_listing(cache, dir);
+
+    if (strcmp(part, "**") == 0) {
+        // Matches no directories...
+        if (!last) expand_parts(dir, parts + 1, nparts - 1, cache, matches);
+
+        // ...or any number of (non-hidden) ones, and everything in them if
+        // it ends the pattern. Symlinks aren't followed so loops can't recurse
+        for (size_t i = 0; i < listing->nentries; i++) {
+            char *name = listing->names + listing->offsets[i];
+            if (name[0] == '.') continue;
+
+            bool found_dir = is_dir(dir, name, listing->types[i], false);
+            if (!found_dir && !last) continue;
+
+            char *path = join_path(dir, name);
+            if (found_dir) expand_parts(path, parts, nparts, cache, matches);
+            if (last) add_match(matches, path);
+            else must_free(path);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < listing->nentries; i++) {
+        char *name = listing->names + listing->offsets[i];
+        if (fnmatch(part, name, FNM_PERIOD) != 0) continue;
+        if (!last && !is_dir(dir, name, listing->types[i], true)) continue;
+
+        char *path = join_path(dir, name);
+        if (last) add_match(matches, path);
+        else {
+            expand_parts(path, parts + 1, nparts - 1, cache, matches);
+            must_free(path);
+        }
+    }
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+char **expand_glob(char *pattern, DirCache *cache, size_t *nmatches) {
+    assert(pattern);
+    assert(cache);
+    assert(nmatches);
+
+    char *copy = must_strdup(pattern);
+    char *rest = copy;
+    char **parts = must_malloc(sizeof *parts * (strlen(pattern) + 1));
+    int nparts = 0;
+    char *dir = (*pattern == '/') ? "/" : "";
+
+    char *part;
+    while ((part = strsep(&rest, "/")) != NULL)
+        if (*part != '\0') parts[nparts++] = part;  // Skip repeated '/'s
+
+    Matches matches = {0};
+    if (nparts > 0) expand_parts(dir, parts, nparts, cache, &matches);
+    must_free(parts);
+    must_free(copy);
+
+    *nmatches = matches.npaths;
+    if (matches.npaths == 0) {
+        must_free(matches.paths);
+        return NULL;
+    }
+    qsort(matches.paths, matches.npaths, sizeof *matches.paths, compare_paths);
+    matches.paths[matches.npaths] = NULL;
+    return matches.paths;
+}
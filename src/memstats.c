@@ -0,0 +1,206 @@
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "errors.h"
+#include "memstats.h"
+
+#define ALLOC_TABLE_SIZE 1024
+
+typedef struct MemCounters {
+    size_t nallocs;
+    size_t bytes;
+    size_t live;
+    size_t peak;
+} MemCounters;
+
+typedef struct Allocation {
+    void *ptr;
+    size_t size;
+    int linenum;
+    MemSubsystem subsystem;
+} Allocation;
+
+static char *subsystem_names[NMEM_SUBSYSTEMS] = {
+    [MEM_OTHER] = "other",
+    [MEM_LEXER] = "lexer",
+    [MEM_STR_BUILDER] = "StrBuilder",
+    [MEM_ENV_STACK] = "EnvStack",
+    [MEM_ARGV] = "argv",
+    [MEM_RESULT] = "Result"
+};
+
+static bool enabled = false;
+static int current_line = 0;
+static MemSubsystem current_subsystem = MEM_OTHER;
+
+// Counters by line then subsystem, and the totals by subsystem
+static MemCounters (*lines)[NMEM_SUBSYSTEMS] = NULL;
+static int nlines = 0;
+static MemCounters totals[NMEM_SUBSYSTEMS];
+
+// Live allocations by pointer (open addressing, linear probing), so frees are
+// counted against where the memory came from. The table itself is allocated
+// with plain malloc, so it isn't counted.
+static Allocation *allocs = NULL;
+static size_t allocs_size = 0;
+static size_t nallocs = 0;
+
+static size_t hash_ptr(void *ptr) {
+    return ((uintptr_t) ptr >> 4) * 11400714819323198485ULL;  // Fibonacci hashing
+}
+
+static size_t find_slot(void *ptr) {
+    size_t mask = allocs_size - 1;
+    size_t i = hash_ptr(ptr) & mask;
+    while (allocs[i].ptr && allocs[i].ptr != ptr) i = (i + 1) & mask;
+    return i;
+}
+
+static void grow_allocs() {
+    Allocation *old = allocs;
+    size_t old_size = allocs_size;
+    allocs_size = allocs_size ? allocs_size * 2 : ALLOC_TABLE_SIZE;
+    allocs = calloc(allocs_size, sizeof *allocs);
+    if (!allocs) die_no_mem();
+    for (size_t i = 0; i < old_size; i++)
+        if (old[i].ptr) allocs[find_slot(old[i].ptr)] = old[i];
+    free(old);
+}
+
+static void remove_slot(size_t i) {
+    // Shift later entries of the same run back, so lookups don't stop early
+    size_t mask = allocs_size - 1;
+    allocs[i].ptr = NULL;
+    for (size_t j = (i + 1) & mask; allocs[j].ptr; j = (j + 1) & mask) {
+        size_t home = hash_ptr(allocs[j].ptr) & mask;
+        bool movable = j > i ? (home <= i || home > j) : (home <= i && home > j);
+        if (!movable) continue;
+        allocs[i] = allocs[j];
+        allocs[j].ptr = NULL;
+        i = j;
+    }
+    nallocs--;
+}
+
+static MemCounters *get_counters(int linenum, MemSubsystem subsystem) {
+    if (linenum >= nlines) {
+        int new_nlines = (linenum + 1) * 2;
+        lines = realloc(lines, sizeof *lines * new_nlines);
+        if (!lines) die_no_mem();
+        memset(lines + nlines, 0, sizeof *lines * (new_nlines - nlines));
+        nlines = new_nlines;
+    }
+    return &lines[linenum][subsystem];
+}
+
+static void count_free(size_t slot) {
+    Allocation *alloc = &allocs[slot];
+    get_counters(alloc->linenum, alloc->subsystem)->live -= alloc->size;
+    totals[alloc->subsystem].live -= alloc->size;
+    remove_slot(slot);
+}
+
+static void count_alloc(MemCounters *counters, size_t size) {
+    counters->nallocs++;
+    counters->bytes += size;
+    counters->live += size;
+    if (counters->live > counters->peak) counters->peak = counters->live;
+}
+
+static void count_resize(MemCounters *counters, size_t old_size, size_t size) {
+    if (size > old_size) counters->bytes += size - old_size;
+    counters->live += size - old_size;  // Wraps back round when it shrinks
+    if (counters->live > counters->peak) counters->peak = counters->live;
+}
+
+static void insert_alloc(Allocation alloc) {
+    // Still here if it was freed without us seeing, its address being reused
+    size_t slot = find_slot(alloc.ptr);
+    if (allocs[slot].ptr) count_free(slot);
+
+    if ((nallocs + 1) * 2 > allocs_size) grow_allocs();
+    allocs[find_slot(alloc.ptr)] = alloc;
+    nallocs++;
+}
+
+static void print_counters(char *line, MemSubsystem subsystem, MemCounters *counters) {
+    fprintf(stderr, "%6s %-12s %10zu %12zu %12zu %12zu\n", line, subsystem_names[subsystem],
+            counters->nallocs, counters->bytes, counters->live, counters->peak);
+}
+
+static void print_mem_stats() {
+    fprintf(stderr, "%6s %-12s %10s %12s %12s %12s\n", "line", "subsystem", "allocs", "bytes",
+            "live", "peak");
+    char line[16];
+    for (int i = 0; i < nlines; i++) {
+        snprintf(line, sizeof line, "%d", i);
+        for (int j = 0; j < NMEM_SUBSYSTEMS; j++)
+            if (lines[i][j].nallocs > 0) print_counters(line, j, &lines[i][j]);
+    }
+    for (int j = 0; j < NMEM_SUBSYSTEMS; j++)
+        if (totals[j].nallocs > 0) print_counters("total", j, &totals[j]);
+}
+
+void enable_mem_stats() {
+    if (enabled) return;
+    enabled = true;
+    grow_allocs();
+    atexit(print_mem_stats);
+}
+
+void set_mem_stats_line(int linenum) {
+    current_line = linenum;
+}
+
+MemSubsystem mem_stats_enter(MemSubsystem subsystem) {
+    MemSubsystem previous = current_subsystem;
+    if (previous == MEM_OTHER) current_subsystem = subsystem;
+    return previous;
+}
+
+void mem_stats_leave(MemSubsystem previous) {
+    current_subsystem = previous;
+}
+
+void mem_stats_alloc(void *ptr) {
+    if (!enabled) return;
+
+    size_t size = malloc_usable_size(ptr);
+    count_alloc(get_counters(current_line, current_subsystem), size);
+    count_alloc(&totals[current_subsystem], size);
+    insert_alloc((Allocation) {
+        .ptr = ptr,
+        .size = size,
+        .linenum = current_line,
+        .subsystem = current_subsystem
+    });
+}
+
+void mem_stats_realloc(void *old_ptr, void *ptr) {
+    if (!enabled) return;
+    size_t slot = old_ptr ? find_slot(old_ptr) : 0;
+    if (!old_ptr || !allocs[slot].ptr) {
+        mem_stats_alloc(ptr);
+        return;
+    }
+
+    // Still the allocation it was, so it stays counted where it was made
+    Allocation alloc = allocs[slot];
+    remove_slot(slot);
+    size_t size = malloc_usable_size(ptr);
+    count_resize(get_counters(alloc.linenum, alloc.subsystem), alloc.size, size);
+    count_resize(&totals[alloc.subsystem], alloc.size, size);
+    alloc.ptr = ptr;
+    alloc.size = size;
+    insert_alloc(alloc);
+}
+
+void mem_stats_free(void *ptr) {
+    if (!enabled || !ptr) return;
+    size_t slot = find_slot(ptr);
+    if (allocs[slot].ptr) count_free(slot);
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -7,33 +8,58 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "context.h"
 #include "errors.h"
 #include "exec.h"
+#include "expand.h"
+#include "memstats.h"
 #include "utils.h"
+#include "watch.h"
+
+#define ARGV_BUF_SIZE 64
 
 Result *parse_scope(FILE *stream, char *argv[], int *linenum, EnvStack *stack, char *bounds);
 Result *parse_start(FILE *stream, int *linenum, EnvStack *stack, char *bounds);
 Result *parse_action(FILE *stream, int *linenum, EnvStack *stack);
 Result *parse_assignment(FILE *stream, char *name, int *linenum, EnvStack *stack);
 Result *parse_command(FILE *stream, char *name, int *linenum, EnvStack *stack);
-int prepare_commands(FILE *stream, char *first_cmd, int *linenum, EnvStack *stack);
-char **extract_args(char *string, char *command, int *linenum, EnvStack *stack);
+Result *parse_value_pipeline(FILE *stream, char *value, int *linenum, EnvStack *stack);
+int prepare_commands(FILE *stream, char *first_cmd, int *linenum, EnvStack *stack,
+                     DirCache *cache);
+char **extract_args(char *string, char *command, int *linenum, EnvStack *stack,
+                    DirCache *cache, int *split_start, int *split_end);
 char *extract_string(char *string, EnvStack *stack);
 char *extract_var(char *var, EnvStack *stack);
+void watch_scope(FILE *stream, int *linenum, EnvStack *stack);
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    // Options come before the script and aren't passed on to it
+    bool watch = false;
+    int nopts = 0;
+    for (; nopts + 1 < argc && strncmp(argv[nopts + 1], "--", 2) == 0; nopts++) {
+        if (strcmp(argv[nopts + 1], "--watch") == 0) watch = true;
+        else if (strcmp(argv[nopts + 1], "--mem-stats") == 0) enable_mem_stats();
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[nopts + 1]);
+            exit(1);
+        }
+    }
+    if (argc < nopts + 2) {
         fprintf(stderr, "No filename given\n");
         exit(1);
     }
-    char *filename = argv[1];
+    char *filename = argv[nopts + 1];
 
     FILE *stream = fopen(filename, "r");
     if (!stream) {
         perror("File could not be read");
         return 1;
     }
+    if (watch) watch_init(copy_argv(argv, argc), filename);
+    argv[nopts] = argv[0];
+    argv += nopts;
+    argc -= nopts;
 
     EnvStack stack = {0};
     int linenum = 1;
@@ -55,16 +81,34 @@ Result *parse_scope(FILE *stream, char *argv[], int *linenum, EnvStack *stack, c
     Result *result = NULL;
     char c;
     while((c = peek_char(stream)) != EOF) {
-        if (result) free(result);  // Free previous result
+        if (result) must_free(result);  // Free previous result
         for (int i = 0; bounds[i] != '\0'; i++) if (c == bounds[i]) goto finish;
+        watch_begin_statement(ftell(stream), *linenum);
         result = parse_start(stream, linenum, stack, NULL);
     }
 
 finish:
+    // The script's own scope stays around to re-run statements in
+    if (argv && is_watching()) watch_scope(stream, linenum, stack);
     pop_stack(stack);
     return result ? result : create_empty_result();
 }
 
+/*
+ * Re-runs statements as what they depend on changes, never returns.
+ */
+void watch_scope(FILE *stream, int *linenum, EnvStack *stack) {
+    long offset;
+    for (;;) {
+        watch_wait();
+        while (watch_next_stale(&offset, linenum)) {
+            fseek(stream, offset, SEEK_SET);
+            Result *result = parse_start(stream, linenum, stack, NULL);
+            if (result) must_free(result);
+        }
+    }
+}
+
 Result *parse_start(FILE *stream, int *linenum, EnvStack *stack, char *bounds) {
     if (!bounds) bounds = "";
     Result *result = NULL;
@@ -73,6 +117,7 @@ Result *parse_start(FILE *stream, int *linenum, EnvStack *stack, char *bounds) {
     char c;
 
 top:
+    set_mem_stats_line(*linenum);
     c = peek_char(stream);
     for (int i = 0; bounds[i] != '\0'; i++) if (c == bounds[i]) goto finish;
     switch(c) {
@@ -99,20 +144,22 @@ top:
             getc(stream);  // Consume ending '"'
             tmp2 = extract_string(tmp, stack);
             result = create_result(tmp2);
-            free(tmp);
-            free(tmp2);
+            must_free(tmp);
+            must_free(tmp2);
             break;
 
         case '$':
             getc(stream);  // Ignore leading '$'
-            c = seek_until_chars(stream, &tmp, "\n \t;");
+            c = seek_until_chars(stream, &tmp, "\n \t;|");
             if (strlen(tmp) < 1)
                 die_invalid_syntax("Expected variable after '$'", *linenum);
 
             tmp2 = extract_var(tmp, stack);
-            result = create_result(tmp2);
-            free(tmp);
-            free(tmp2);
+            must_free(tmp);
+            if (c == ' ' || c == '\t') c = seek_for_spaces(stream);
+            if (c == '|') result = parse_value_pipeline(stream, tmp2, linenum, stack);
+            else result = create_result(tmp2);
+            must_free(tmp2);
             break;
 
         //case '(':
@@ -134,7 +181,7 @@ top:
         default:
             seek_until_chars(stream, &tmp, "\n \t;");
             result = create_result(tmp);
-            free(tmp);
+            must_free(tmp);
             break;
     }
 finish:
@@ -159,18 +206,64 @@ Result *parse_assignment(FILE *stream, char *name, int *linenum, EnvStack *stack
     getc(stream);  // Consume '='
     Result *result = parse_start(stream, linenum, stack, "\n;");
     add_stack_var(stack, name, result->output);
-    free(name);
+    must_free(name);
+    return result;
+}
+
+/*
+ * Runs the pipeline after '|' with the value as its stdin, as if echoed in
+ * but without an echo process or a pipe.
+ */
+Result *parse_value_pipeline(FILE *stream, char *value, int *linenum, EnvStack *stack) {
+    getc(stream);  // Consume pipe
+    seek_for_spaces(stream);
+    char *name = NULL;
+    char c = seek_until_chars(stream, &name, "\n \t;|");
+    if (strlen(name) < 1) die_invalid_syntax("Expected command after '|'", *linenum);
+    if (c == ' ' || c == '\t') seek_for_spaces(stream);
+
+    // Standing in for the shell's own stdin means cached pipelines hash it too
+    char *args[] = { value, NULL };
+    int value_fd = echo_to_fd(args);
+    int saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    dup2(value_fd, STDIN_FILENO);
+    close(value_fd);
+    Result *result = parse_command(stream, name, linenum, stack);
+    dup2(saved_stdin, STDIN_FILENO);
+    close(saved_stdin);
     return result;
 }
 
 Result *parse_command(FILE *stream, char *name, int *linenum, EnvStack *stack) {
-    int ncmds = prepare_commands(stream, name, linenum, stack);
-    Result *result = pipeline_cmds(stack, ncmds);
+    // Globs in the same statement share directory listings
+    DirCache *cache = dir_cache_create();
+    int ncmds = prepare_commands(stream, name, linenum, stack, cache);
+    destroy_dir_cache(cache);
+
+    Result *result;
+    if (is_cached_pipeline(stack)) {
+        char **inputs = strip_cached_annotation(stack);
+        if (get_env(stack)->argv[0] == NULL)
+            die_invalid_syntax("Expected command after 'cached'", *linenum);
+        result = cached_pipeline_cmds(stack, ncmds, inputs);
+    }
+    else result = pipeline_cmds(stack, ncmds);
     set_last_exit_code(stack, result->code);
+
+    char usage[32];
+    if (result->mem_peak >= 0) {
+        snprintf(usage, sizeof usage, "%lld", result->mem_peak);
+        add_stack_var(stack, "PLSH_MEM_PEAK", usage);
+    }
+    if (result->cpu_usec >= 0) {
+        snprintf(usage, sizeof usage, "%lld", result->cpu_usec);
+        add_stack_var(stack, "PLSH_CPU_USEC", usage);
+    }
     return result;
 }
 
-int prepare_commands(FILE *stream, char *first_cmd, int *linenum, EnvStack *stack) {
+int prepare_commands(FILE *stream, char *first_cmd, int *linenum, EnvStack *stack,
+                     DirCache *cache) {
     // FIXME: Passing the command name in is kinda ugly, we should parse the
     //        command name in this function.
     char *args_string = NULL;
@@ -178,9 +271,11 @@ int prepare_commands(FILE *stream, char *first_cmd, int *linenum, EnvStack *stac
     int ncmds = 1;
 
     char c = seek_until_chars(stream, &args_string, "\n;#|");
-    char **argv = extract_args(args_string, first_cmd, linenum, stack);
-    free(args_string);
-    free(first_cmd);
+    int split_start, split_end;
+    char **argv = extract_args(args_string, first_cmd, linenum, stack, cache,
+                               &split_start, &split_end);
+    must_free(args_string);
+    must_free(first_cmd);
 
     if (c == '|') {
         getc(stream);  // Consume pipe
@@ -192,27 +287,54 @@ int prepare_commands(FILE *stream, char *first_cmd, int *linenum, EnvStack *stac
         else if (strlen(next_cmd) < 1)
             die_invalid_syntax("Expected command after '|'", *linenum);
 
-        ncmds += prepare_commands(stream, next_cmd, linenum, stack);
+        ncmds += prepare_commands(stream, next_cmd, linenum, stack, cache);
+    }
+    // Strip a leading 'deadline DURATION' off the command
+    long deadline_ms = -1;
+    if (strcmp(argv[0], "deadline") == 0) {
+        if (argv[1] == NULL || (deadline_ms = parse_duration_ms(argv[1])) == -1)
+            die_invalid_syntax("Expected duration after 'deadline'", *linenum);
+        if (argv[2] == NULL)
+            die_invalid_syntax("Expected command after 'deadline'", *linenum);
+
+        must_free(argv[0]);
+        must_free(argv[1]);
+        int argc = 2;
+        while (argv[argc] != NULL) argc++;
+        memmove(argv, argv + 2, sizeof *argv * (argc - 1));
+        if (split_start != -1) {
+            split_start -= 2;
+            split_end -= 2;
+        }
     }
+
     push_stack(stack, argv);
+    get_env(stack)->split_start = split_start;
+    get_env(stack)->split_end = split_end;
+    get_env(stack)->deadline_ms = deadline_ms;
     return ncmds;
 }
 
-char **extract_args(char *string, char *command, int *linenum, EnvStack *stack) {
+char **extract_args(char *string, char *command, int *linenum, EnvStack *stack,
+                    DirCache *cache, int *split_start, int *split_end) {
     assert(string);
-    long conf_max_args = sysconf(_SC_ARG_MAX);
-    size_t max_args = 64;
-    if (conf_max_args > 0) max_args = (size_t) conf_max_args;
-
+    MemSubsystem previous = mem_stats_enter(MEM_ARGV);
+    // Grown as needed, whether it fits the kernel's limits is up to exec
+    size_t max_args = ARGV_BUF_SIZE;
     char **argv_buf = must_malloc(sizeof *argv_buf * max_args);
     argv_buf[0] = must_strdup(command);
     size_t argc = 1;
+    *split_start = -1;
+    *split_end = -1;
 
     bool reached_end = false;
     bool empty = false;
     char *arg = NULL;
     bool complete_arg = false;
+    char **matches = NULL;
+    size_t nmatches = 0;
     char *string_end = string + strlen(string);
+    bool splittable = true;
     while(string < string_end) {
         complete_arg = false;
         switch(*string) {
@@ -233,9 +355,11 @@ char **extract_args(char *string, char *command, int *linenum, EnvStack *stack)
                 if (empty)
                     die_invalid_syntax("Expected variable after '$'", *linenum);
 
-                arg = extract_var(arg, stack);
+                // Record fields ($.1, $.name) are for the builtin stage reading
+                // the records, so keep the '$' and leave them alone
+                if (*arg == '.') arg = must_strdup(arg - 1);
+                else arg = extract_var(arg, stack);
                 complete_arg = true;
-                string++;
                 break;
 
             case '"':
@@ -262,16 +386,41 @@ char **extract_args(char *string, char *command, int *linenum, EnvStack *stack)
                 reached_end = (string == NULL);
                 if (reached_end) string = string_end;
 
+                // A glob that matches nothing is passed on as is
+                matches = has_glob_chars(arg) ? expand_glob(arg, cache, &nmatches) : NULL;
+                if (matches) {
+                    if (argc + nmatches >= max_args) {
+                        max_args = (argc + nmatches) * 2;
+                        argv_buf = must_realloc(argv_buf, sizeof *argv_buf * max_args);
+                    }
+                    // Only one range can be split, and every invocation needs
+                    // whatever isn't in it, so an argument between two globs'
+                    // matches means no splitting at all
+                    if (*split_start == -1) *split_start = argc;
+                    else if (*split_end != (int) argc) splittable = false;
+                    for (size_t i = 0; i < nmatches; i++) argv_buf[argc++] = matches[i];
+                    *split_end = argc;
+                    must_free(matches);
+                    break;
+                }
+
                 arg = must_strdup(arg);
                 complete_arg = true;
                 break;
         }
         assert(string);
-        if (argc >= max_args) die_invalid_syntax("Too many args", *linenum);
+        if (argc + 1 >= max_args) {
+            max_args *= 2;
+            argv_buf = must_realloc(argv_buf, sizeof *argv_buf * max_args);
+        }
         if (complete_arg) argv_buf[argc++] = arg;
     }
     argv_buf[argc] = NULL;
+    if (!splittable) *split_start = *split_end = -1;
+    if (is_watching())
+        for (size_t i = 0; i < argc; i++) watch_note_path(argv_buf[i]);
     argv_buf = must_realloc(argv_buf, sizeof(*argv_buf) * (argc + 1));
+    mem_stats_leave(previous);
     return argv_buf;
 }
 
@@ -320,9 +469,9 @@ char *extract_string(char *string, EnvStack *stack) {
         assert(string);
         string++;
     }
-    char *string = str_build_to_str(build);
-    destroy_str_build(build);
-    return string;
+    char *str = str_build_to_str(build);
+    must_free(build);  // The buffer is the string now
+    return str;
 }
 
 char *extract_var(char *var, EnvStack *stack) {
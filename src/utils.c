@@ -1,33 +1,47 @@
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "utils.h"
 #include "errors.h"
+#include "memstats.h"
 
 #define STR_BUF_SIZE 64
+#define LINE_BUF_SIZE (1 << 18)
 
 static void ensure_str_build_bounds(StrBuilder *build, size_t by) {
     size_t needed_size = build->size + by + 1;  // Plus null terminator
     if (needed_size > build->bufsize) {
+        MemSubsystem previous = mem_stats_enter(MEM_STR_BUILDER);
         build->bufsize = needed_size * 2;
         build->buf = must_realloc(build->buf, build->bufsize);
+        mem_stats_leave(previous);
     }
 }
 
 StrBuilder *str_build_create() {
+    MemSubsystem previous = mem_stats_enter(MEM_STR_BUILDER);
     StrBuilder *build = must_malloc(sizeof *build);
     build->buf = must_malloc(STR_BUF_SIZE);
+    build->buf[0] = '\0';
     build->bufsize = STR_BUF_SIZE;
     build->size = 0;
+    mem_stats_leave(previous);
     return build;
 }
 
 void destroy_str_build(StrBuilder *build) {
     assert(build);
-    free(build->buf);
-    free(build);
+    must_free(build->buf);
+    must_free(build);
 }
 
 void str_build_add_c(StrBuilder *build, char c) {
@@ -42,38 +56,168 @@ void str_build_add_str(StrBuilder *build, char *str) {
     assert(str);
     int len = strlen(str);
     ensure_str_build_bounds(build, len);
-    // '<=': Include null terminator
-    for (int i = 0; i <= len; i++) build->buf[build->size++] = str[i];
+    for (int i = 0; i < len; i++) build->buf[build->size++] = str[i];
+    build->buf[build->size] = '\0';
 }
 
 char *str_build_to_str(StrBuilder *build) {
+    MemSubsystem previous = mem_stats_enter(MEM_STR_BUILDER);
     build->buf = must_realloc(build->buf, build->size + 1);  // Plus null terminator
+    mem_stats_leave(previous);
     return build->buf;
 }
 
+static bool map_line_reader(LineReader *reader) {
+    struct stat st;
+    if (fstat(reader->fd, &st) == -1 || !S_ISREG(st.st_mode)) return false;
+    if (st.st_size == 0) return false;
+
+    // Records are handed out from where the fd currently is, like read(2)
+    off_t offset = lseek(reader->fd, 0, SEEK_CUR);
+    if (offset == -1 || offset >= st.st_size) return false;
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+    if (map == MAP_FAILED) return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    reader->buf = map;
+    reader->bufsize = st.st_size;
+    reader->start = offset;
+    reader->end = st.st_size;
+    reader->mapped = true;
+    reader->eof = true;
+    return true;
+}
+
+static void fill_line_reader(LineReader *reader) {
+    // Move the partial record to the front, growing if it fills the buffer
+    size_t partial = reader->end - reader->start;
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start, partial);
+        reader->start = 0;
+        reader->end = partial;
+    }
+    if (reader->end == reader->bufsize) {
+        reader->bufsize *= 2;
+        reader->buf = must_realloc(reader->buf, reader->bufsize);
+    }
+
+    ssize_t nread;
+    do {
+        nread = read(reader->fd, reader->buf + reader->end,
+                     reader->bufsize - reader->end);
+    } while (nread == -1 && errno == EINTR);
+    if (nread == -1) die_errno("Failed to read");
+    if (nread == 0) reader->eof = true;
+    reader->end += nread;
+}
+
+LineReader *line_reader_create(int fd, char delim) {
+    LineReader *reader = must_malloc(sizeof *reader);
+    reader->fd = fd;
+    reader->delim = delim;
+    reader->start = 0;
+    reader->end = 0;
+    reader->mapped = false;
+    reader->eof = false;
+    if (!map_line_reader(reader)) {
+        reader->buf = must_malloc(LINE_BUF_SIZE);
+        reader->bufsize = LINE_BUF_SIZE;
+    }
+    return reader;
+}
+
+void destroy_line_reader(LineReader *reader) {
+    assert(reader);
+    if (reader->mapped) {
+        // Leave the fd where a read(2) based reader would have
+        lseek(reader->fd, reader->start, SEEK_SET);
+        munmap(reader->buf, reader->bufsize);
+    }
+    else must_free(reader->buf);
+    must_free(reader);
+}
+
+char *line_reader_next(LineReader *reader, size_t *len) {
+    assert(reader);
+    assert(len);
+    char *found;
+    size_t scanned = 0;  // Don't rescan the partial record after a refill
+    for (;;) {
+        char *record = reader->buf + reader->start;
+        size_t avail = reader->end - reader->start;
+        found = memchr(record + scanned, reader->delim, avail - scanned);
+        if (found) {
+            *len = found - record;
+            reader->start += *len + 1;  // Skip delimiter
+            return record;
+        }
+        if (reader->eof) {
+            if (avail == 0) return NULL;
+            // Last record without a trailing delimiter
+            *len = avail;
+            reader->start = reader->end;
+            return record;
+        }
+        scanned = avail;
+        fill_line_reader(reader);
+    }
+}
+
+long parse_duration_ms(char *duration) {
+    if (!duration || *duration == '\0') return -1;
+
+    char *unit;
+    double amount = strtod(duration, &unit);
+    if (unit == duration || amount < 0) return -1;
+
+    double scale;
+    if (strcmp(unit, "") == 0 || strcmp(unit, "s") == 0) scale = 1000;
+    else if (strcmp(unit, "ms") == 0) scale = 1;
+    else if (strcmp(unit, "m") == 0) scale = 60 * 1000;
+    else if (strcmp(unit, "h") == 0) scale = 60 * 60 * 1000;
+    else return -1;
+
+    // strtod also takes inf, nan and 1e30, none of which fit in a long
+    double ms = amount * scale;
+    if (!isfinite(ms) || ms >= (double) LONG_MAX) return -1;
+    return (long) ms;
+}
+
 void *must_malloc(size_t size) {
     void *ptr = malloc(size);
     if (!ptr) die_no_mem();
+    mem_stats_alloc(ptr);
     return ptr;
 }
 
 void *must_realloc(void *ptr, size_t size) {
     // FIXME: Non-GNU will not free new alloc
+    uintptr_t old_addr = (uintptr_t) ptr;  // Only a key for the stats once freed
     ptr = realloc(ptr, size);
     if (!ptr) die_no_mem();
+    mem_stats_realloc((void *) old_addr, ptr);
     return ptr;
 }
 
 char *must_strdup(char *string) {
     string = strdup(string);
     if (!string) die_no_mem();
+    mem_stats_alloc(string);
     return string;
 }
 
+void must_free(void *ptr) {
+    mem_stats_free(ptr);
+    free(ptr);
+}
+
 char **copy_argv(char *argv[], int argc) {
-    char **new_argv = malloc(sizeof *new_argv * (argc + 1));
+    MemSubsystem previous = mem_stats_enter(MEM_ARGV);
+    char **new_argv = must_malloc(sizeof *new_argv * (argc + 1));
     for (int i = 0; i < argc; i++) new_argv[i] = must_strdup(argv[i]);
     new_argv[argc] = NULL;
+    mem_stats_leave(previous);
     return new_argv;
 }
 
@@ -0,0 +1,272 @@
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "errors.h"
+#include "utils.h"
+#include "watch.h"
+
+#define EVENT_BUF_SIZE (4096 * sizeof(struct inotify_event))
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE \
+                    | IN_ATTRIB)
+
+// Editors save in bursts (write, rename, chmod), so wait for them to settle
+#define WATCH_SETTLE_MS 50
+
+typedef struct StrList {
+    char **strs;
+    size_t nstrs;
+} StrList;
+
+typedef struct Statement {
+    long offset;
+    int linenum;
+    StrList reads;
+    StrList writes;
+    StrList paths;  // Real paths
+    bool stale;
+} Statement;
+
+// Files are watched through their directory, so that they're still watched
+// after an editor replaces them
+typedef struct Watcher {
+    int wd;
+    char *path;
+    char *name;  // Entry in the directory that is the path, NULL for any
+} Watcher;
+
+typedef struct Watch {
+    char **plsh_argv;
+    char *script;  // Real path
+    int inotify_fd;
+    Statement *statements;
+    size_t nstatements;
+    Statement *current;
+    size_t next;  // Next statement to consider re-running
+    StrList changed_vars;
+    Watcher *watchers;
+    size_t nwatchers;
+} Watch;
+
+static Watch *watch = NULL;
+
+static bool has_str(StrList *list, char *str) {
+    for (size_t i = 0; i < list->nstrs; i++)
+        if (strcmp(list->strs[i], str) == 0) return true;
+    return false;
+}
+
+static void add_str(StrList *list, char *str) {
+    if (has_str(list, str)) return;
+    list->strs = must_realloc(list->strs, sizeof *list->strs * (list->nstrs + 1));
+    list->strs[list->nstrs++] = must_strdup(str);
+}
+
+static void clear_strs(StrList *list) {
+    for (size_t i = 0; i < list->nstrs; i++) must_free(list->strs[i]);
+    list->nstrs = 0;
+}
+
+void watch_init(char *plsh_argv[], char *script) {
+    assert(!watch);
+    char path[PATH_MAX];
+    if (!realpath(script, path)) die_errno(script);
+
+    watch = must_malloc(sizeof *watch);
+    *watch = (Watch) { .plsh_argv = plsh_argv, .script = must_strdup(path) };
+    watch->inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (watch->inotify_fd == -1) die_errno("Failed to watch script");
+}
+
+bool is_watching() {
+    return watch != NULL;
+}
+
+static void begin_statement(Statement *statement) {
+    clear_strs(&statement->reads);
+    clear_strs(&statement->writes);
+    clear_strs(&statement->paths);
+    statement->stale = false;
+    watch->current = statement;
+}
+
+void watch_begin_statement(long offset, int linenum) {
+    if (!watch) return;
+    for (size_t i = 0; i < watch->nstatements; i++) {
+        if (watch->statements[i].offset == offset) {
+            begin_statement(&watch->statements[i]);
+            return;
+        }
+    }
+
+    watch->statements = must_realloc(watch->statements,
+                                     sizeof *watch->statements * (watch->nstatements + 1));
+    Statement *statement = &watch->statements[watch->nstatements++];
+    *statement = (Statement) { .offset = offset, .linenum = linenum };
+    begin_statement(statement);
+}
+
+void watch_note_var(char *name, bool written) {
+    if (!watch || !watch->current) return;
+    add_str(written ? &watch->current->writes : &watch->current->reads, name);
+}
+
+void watch_note_path(char *path) {
+    if (!watch || !watch->current) return;
+    char real[PATH_MAX];
+    if (realpath(path, real)) add_str(&watch->current->paths, real);
+}
+
+static void add_watcher(char *dir, char *path, char *name) {
+    int wd = inotify_add_watch(watch->inotify_fd, dir, WATCH_MASK);
+    if (wd == -1) return;  // Gone already or not ours to watch, nothing to re-run for
+
+    watch->watchers = must_realloc(watch->watchers,
+                                   sizeof *watch->watchers * (watch->nwatchers + 1));
+    watch->watchers[watch->nwatchers++] = (Watcher) {
+        .wd = wd,
+        .path = must_strdup(path),
+        .name = name ? must_strdup(name) : NULL
+    };
+}
+
+static void watch_path(char *path) {
+    for (size_t i = 0; i < watch->nwatchers; i++)
+        if (strcmp(watch->watchers[i].path, path) == 0) return;
+
+    // Real paths are absolute, so there's always a '/'
+    char *slash = strrchr(path, '/');
+    char *dir = must_strdup(path);
+    dir[slash == path ? 1 : slash - path] = '\0';
+    add_watcher(dir, path, slash + 1);
+    must_free(dir);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) add_watcher(path, path, NULL);
+}
+
+static void clear_watchers() {
+    for (size_t i = 0; i < watch->nwatchers; i++) {
+        must_free(watch->watchers[i].path);
+        must_free(watch->watchers[i].name);
+    }
+    watch->nwatchers = 0;
+}
+
+/*
+ * Reads the pending events, adding the paths they're about to the list.
+ * Returns whether there were any.
+ */
+static bool read_events(StrList *changed) {
+    char buf[EVENT_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool any = false;
+    for (;;) {
+        ssize_t nread = read(watch->inotify_fd, buf, sizeof buf);
+        if (nread == -1 && errno == EINTR) continue;
+        if (nread == -1 && errno == EAGAIN) return any;
+        if (nread == -1) die_errno("Failed to read watch events");
+        any = true;
+
+        struct inotify_event *event;
+        for (char *ptr = buf; ptr < buf + nread; ptr += sizeof *event + event->len) {
+            event = (struct inotify_event *) ptr;
+            for (size_t i = 0; i < watch->nwatchers; i++) {
+                Watcher *watcher = &watch->watchers[i];
+                if (watcher->wd != event->wd) continue;
+                if (!watcher->name || (event->len > 0 && strcmp(watcher->name, event->name) == 0))
+                    add_str(changed, watcher->path);
+            }
+        }
+    }
+}
+
+static bool wait_for_events(int timeout_ms) {
+    struct pollfd pollfd = { .fd = watch->inotify_fd, .events = POLLIN };
+    for (;;) {
+        int ready = poll(&pollfd, 1, timeout_ms);
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready == -1) die_errno("Failed to wait for watch events");
+        return ready > 0;
+    }
+}
+
+static void restart() {
+    fprintf(stderr, "%s changed, restarting\n", watch->script);
+    fflush(stdout);
+    execv("/proc/self/exe", watch->plsh_argv);
+    die_errno("Failed to restart");
+}
+
+void watch_wait() {
+    assert(watch);
+    watch->current = NULL;
+    StrList changed = {0};
+    bool any_stale = false;
+
+    // What's queued came from the statements that just ran (e.g. 'cp a b'
+    // writing b), which would otherwise set them off again forever
+    read_events(&changed);
+
+    while (!any_stale) {
+        // Statements may reference new paths after each re-run. Watches are
+        // never removed, adding one again gives back the same descriptor so
+        // events already queued for it still match
+        clear_watchers();
+        watch_path(watch->script);
+        for (size_t i = 0; i < watch->nstatements; i++) {
+            StrList *paths = &watch->statements[i].paths;
+            for (size_t j = 0; j < paths->nstrs; j++) watch_path(paths->strs[j]);
+        }
+
+        wait_for_events(-1);
+        clear_strs(&changed);
+        while (read_events(&changed) && wait_for_events(WATCH_SETTLE_MS)) continue;
+        if (has_str(&changed, watch->script)) restart();
+
+        for (size_t i = 0; i < watch->nstatements; i++) {
+            Statement *statement = &watch->statements[i];
+            for (size_t j = 0; j < changed.nstrs && !statement->stale; j++)
+                statement->stale = has_str(&statement->paths, changed.strs[j]);
+            any_stale |= statement->stale;
+        }
+    }
+    must_free(changed.strs);
+
+    clear_strs(&watch->changed_vars);
+    watch->next = 0;
+}
+
+static bool reads_changed_var(Statement *statement) {
+    for (size_t i = 0; i < statement->reads.nstrs; i++)
+        if (has_str(&watch->changed_vars, statement->reads.strs[i])) return true;
+    return false;
+}
+
+bool watch_next_stale(long *offset, int *linenum) {
+    assert(watch);
+    // What the last re-run wrote can make later statements stale
+    if (watch->current) {
+        StrList *writes = &watch->current->writes;
+        for (size_t i = 0; i < writes->nstrs; i++) add_str(&watch->changed_vars, writes->strs[i]);
+    }
+
+    while (watch->next < watch->nstatements) {
+        Statement *statement = &watch->statements[watch->next++];
+        if (!statement->stale && !reads_changed_var(statement)) continue;
+
+        begin_statement(statement);
+        *offset = statement->offset;
+        *linenum = statement->linenum;
+        return true;
+    }
+    watch->current = NULL;
+    return false;
+}
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Times the builtin stages against the coreutils pipelines they stand in for,
+# both run through plsh on the same generated CSV. Should be executed in test
+# directory.
+#
+# Usage:
+# ./builtins_bench.sh [LINES] (Defaults to 1000000 lines of input)
+
+die() {
+    echo "$1" > /dev/stderr
+    exit 1
+}
+
+lines=${1:-1000000}
+exe="`pwd`/../plsh"
+if [ ! -f $exe ]; then
+    die "Not in tests directory"
+fi
+
+# Byte order for both, otherwise coreutils sort pays for the locale
+export LC_ALL=C
+dir=`mktemp -d`
+awk -v n=$lines 'BEGIN {
+    srand(1)
+    for (i = 0; i < n; i++)
+        printf "%d,user%d,%s\n", i, int(rand() * 10000), rand() < 0.5 ? "GET" : "POST"
+}' > $dir/input.csv
+
+# Runs the pipeline through plsh, printing the wall clock seconds it took
+run() {
+    echo "cat input.csv | $1" > $dir/bench.plsh
+    TIMEFORMAT=%R
+    { time (cd $dir && $exe bench.plsh > /dev/null 2>&1); } 2>&1
+}
+
+bench() {
+    printf "%-24s coreutils %6ss  builtin %6ss\n" "$1" "`run "$2"`" "`run "$3"`"
+}
+
+echo "$lines lines"
+bench "cut | sort | uniq -c" \
+    "cut -d , -f 2 | sort | uniq -c" \
+    "builtin cut -d , -f 2 | builtin sort | builtin uniq -c"
+bench "grep | cut | sort" \
+    "grep -F POST | cut -d , -f 2 | sort" \
+    "builtin grep -F POST | builtin cut -d , -f 2 | builtin sort"
+bench "sort -n" \
+    "cut -d , -f 1 | sort -n" \
+    "builtin cut -d , -f 1 | builtin sort -n"
+bench "count" \
+    "cut -d , -f 3 | sort | uniq -c" \
+    "builtin cut -d , -f 3 | builtin count"
+
+rm -r $dir
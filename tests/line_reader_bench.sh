@@ -0,0 +1,67 @@
+#!/bin/bash
+# Times splitting input into lines with LineReader, from a regular file (which
+# it mmaps) and from a pipe, next to wc -l doing the same scan. Needs plsh to
+# have been built, the reader is linked from its objects. Should be executed
+# in test directory.
+#
+# The target is 1 GB/s on one core. On a 1 core VM the file case meets it at
+# about 1.4 GB/s (wc -l 1.8 GB/s). The pipe case falls short at about 0.75
+# GB/s (wc -l 1.1 GB/s): the writer's copy into the pipe takes turns with the
+# scan on the one core, and a memchr per 64 byte record costs more than
+# wc's counting scan.
+#
+# Usage:
+# ./line_reader_bench.sh [MB] (Defaults to 512 MB of input)
+
+die() {
+    echo "$1" > /dev/stderr
+    exit 1
+}
+
+mb=${1:-512}
+obj=../obj
+if [ ! -f $obj/utils.o ]; then
+    die "Not in tests directory, or plsh isn't built"
+fi
+
+dir=`mktemp -d`
+cat > $dir/reader.c << EOF
+#include <stdio.h>
+#include <unistd.h>
+#include "utils.h"
+
+int main() {
+    LineReader *reader = line_reader_create(STDIN_FILENO, '\n');
+    size_t len, nlines = 0;
+    while (line_reader_next(reader, &len) != NULL) nlines++;
+    destroy_line_reader(reader);
+    printf("%zu\n", nlines);
+    return 0;
+}
+EOF
+${CC:-gcc} -O2 -I../include -o $dir/reader $dir/reader.c $obj/utils.o $obj/memstats.o \
+    $obj/errors.o || die "Failed to build the reader"
+
+awk -v n=$((mb * 1024 * 1024 / 64)) 'BEGIN {
+    srand(1)
+    for (i = 0; i < n; i++) printf "%010d,user%08d,%-37s\n", i, int(rand() * 10000), "GET"
+}' > $dir/input.txt
+size=`stat -c %s $dir/input.txt`
+
+# Prints the throughput of the given command, which reads input.txt
+run() {
+    TIMEFORMAT=%R
+    seconds=`{ time (cd $dir && eval "$1" > /dev/null); } 2>&1`
+    awk -v size=$size -v s=$seconds 'BEGIN { printf "%6.2f GB/s", size / s / 1e9 }'
+}
+
+# Warm the page cache so the file case isn't timing the disk
+cat $dir/input.txt > /dev/null
+
+echo "$((size / 1024 / 1024)) MB of lines"
+printf "%-6s LineReader %s  wc -l %s\n" "file" "`run "./reader < input.txt"`" \
+    "`run "wc -l < input.txt"`"
+printf "%-6s LineReader %s  wc -l %s\n" "pipe" "`run "cat input.txt | ./reader"`" \
+    "`run "cat input.txt | wc -l"`"
+
+rm -r $dir